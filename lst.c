@@ -32,8 +32,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "lst.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define LST_HAVE_X86_SIMD
+#  include <immintrin.h>
+#endif
+
 /*
  * Leftmost Skeleton Trees are defined in "Stronger Quickheaps" (Gonzalo Navarro,
  * Rodrigo Paredes, Patricio V. Poblete, and Peter Sanders) International Journal
@@ -54,32 +62,251 @@
 
 typedef int	stack_index_t;
 
+/*
+ * What we know about the order of the elements in a bucket, beyond
+ * their being between the bucket's pivots.
+ */
+typedef enum {
+	BUCKET_UNORDERED = 0,
+	BUCKET_EQUAL,		/* all elements compare equal */
+	BUCKET_SORTED		/* elements ascend from the left */
+} bucket_order_t;
+
+/*
+ * How an LST lays out its elements, and whether it writes their indexes,
+ * as far as the hot paths care. Those are specialized on it, as they are
+ * on whether the LST caches keys; see LAYOUT_SPECIALIZE().
+ */
+typedef unsigned int	layout_t;
+
+#define LAYOUT_FLAT		0		/* one circular array */
+#define LAYOUT_SEGMENTED	(1 << 0)	/* segments, reached through a directory */
+#define LAYOUT_MODULAR		(1 << 1)	/* one circular array, of a capacity that isn't a power of two */
+#define LAYOUT_UNINDEXED	(1 << 2)	/* elements have no index */
+
+/*
+ * A key loaded from an element, for LSTs with a key type, or a cached key.
+ */
+typedef union {
+	int32_t		i32;
+	int64_t		i64;
+	double		d;
+	uint64_t	u64;
+} lst_key_t;
+
+/*
+ * Returns a mask of which of n (<= 64) contiguous elements are on the wrong
+ * side of the pivot, for the left or right side of a block partition, and
+ * sets ties to a mask of those whose keys equal the pivot's.
+ */
+typedef uint64_t (*lst_classify_t)(void * const *in, int n, lst_key_type_t type, size_t key_offset,
+				   lst_key_t pivot, bool right, uint64_t *ties);
+
 typedef struct {
 	stack_index_t	depth;
 	stack_index_t	size;
 	lst_index_t	*data;	/* array of indices of the pivots (also called roots) */
+	uint8_t		*order;	/* bucket_order_t of the bucket at each stack index */
+	uint8_t		*slack;	/* tombstones just below each pivot; see bucket_fill_slack() */
+	uint64_t	*key;	/* cached key of each pivot, for LSTs that cache keys */
 }	pivot_stack_t;
 
 struct lst_s {
 	lst_index_t	capacity;	//!< Number of elements that will fit
+	lst_index_t	modulus;	//!< Positions are reduced modulo this to indices.
+	lst_index_t	index_mask;	//!< modulus - 1, to reduce by if modulus is a power of two.
 	lst_index_t	idx;		//!< Starting index, initially zero
 	lst_index_t	num_elements;	//!< Number of elements in the LST
 	size_t		offset;		//!< Offset of heap index in element structure.
-	void		**p;		//!< Array of elements.
+	layout_t	layout;		//!< How the elements are laid out.
+	void		**p;		//!< Array of elements, or NULL if segmented.
+	uint64_t	*keys;		//!< Cached key of each element in p, or NULL.
+	void		***segment;	//!< Directory of element segments, or NULL.
+	uint64_t	**key_segment;	//!< Directory of cached key segments, or NULL.
+	lst_index_t	segments;	//!< Number of slots in the directories.
+	lst_key_project_t key_project;	//!< Projects elements onto their cached keys.
 	lst_cmp_t	cmp;		//!< Comparator function.
 	pivot_stack_t	s;		//!< Stack of pivots, always with depth >= 1.
+	uint64_t	rng;		//!< Per-instance PRNG state, never zero.
+	lst_pivot_policy_t pivot_policy; //!< How partition() picks pivots.
+	uint8_t		pivot_quantile;	//!< Percentile used by LST_PIVOT_QUANTILE.
+	lst_partition_t	partition;	//!< Partitioning scheme.
+	lst_key_type_t	key_type;	//!< Type of key at key_offset, or LST_KEY_NONE.
+	size_t		key_offset;	//!< Offset of key in element structure.
+	lst_classify_t	classify;	//!< Keyed classification kernel for this CPU.
+	uint8_t		multiway;	//!< Ways to split large buckets, or 0.
+	lst_index_t	sort_threshold;	//!< Largest leftmost bucket to sort rather than partition.
+	bool		preserve_pivots; //!< Repair, rather than flatten, on extracting a pivot.
+	void		*tombstone;	//!< Stands in for lazily deleted elements, or NULL.
+	lst_index_t	tombstones;	//!< Number of tombstones in p.
+	uint8_t		bucket_slack;	//!< Free slots to leave in a bucket an insert makes room in.
+	stack_index_t	clean_from;	//!< Buckets from this stack index up hold no tombstones.
+	double		lazy_delete;	//!< Fraction of tombstones at which to compact.
+	void		**scratch;	//!< Scratch array for multi-way partitions.
+	uint8_t		*oracle;	//!< Bucket of each element, for multi-way partitions.
+	lst_index_t	scratch_size;	//!< Number of elements the scratch arrays hold.
+	bool		shrink;		//!< Shrink as the LST empties.
+	lst_index_t	min_capacity;	//!< Capacity the LST starts with and won't shrink below.
+	double		growth;		//!< Factor to grow capacity by when full.
+	lst_index_t	shrink_at;	//!< Shrink when num_elements falls below this; 0 if never.
+	bool		prefetch;	//!< Prefetch elements ahead of moving or comparing them.
+	uint8_t		bad_splits;	//!< Badly skewed partitions in a row.
+	uint64_t	rebalances;	//!< Times the pivot stack has been thinned.
 };
 
 #define index_addr(_lst, _data) ((uint8_t *)(_data) + (_lst)->offset)
 #define item_index(_lst, _data) (*(lst_index_t *)index_addr((_lst), (_data)))
+#define tombstone_size(_lst)	(is_indexed((_lst)->layout) ? (_lst)->offset + sizeof(lst_index_t) : sizeof(lst_index_t))
 
-#define is_equivalent(_lst, _index1, _index2)	(index_reduce((_lst), (_index1) - (_index2)) == 0)
-#define item(_lst, _index)			((_lst)->p[index_reduce((_lst), (_index))])
-#define index_reduce(_lst, _index)		((_index) & ((_lst)->capacity - 1))
-#define pivot_item(_lst, _index)		item((_lst), stack_item(&(_lst)->s, (_index)))
-
+#define likely(_x)	__builtin_expect(!!(_x), 1)
 #define unlikely(_x)	__builtin_expect((_x), 0)
 
+#define is_segmented(_layout)			(((_layout) & LAYOUT_SEGMENTED) != 0)
+#define is_modular(_layout)			(((_layout) & LAYOUT_MODULAR) != 0)
+#define is_indexed(_layout)			(((_layout) & LAYOUT_UNINDEXED) == 0)
+
+/*
+ * Positions are kept within [0, 2 * modulus). If the modulus is a power of
+ * two, as it is unless an LST was given some other capacity, a mask
+ * reduces them; otherwise a conditional subtract does. Offsets between
+ * positions, within [-modulus, modulus], may need an add instead, though
+ * the mask reduces them just the same.
+ */
+static inline __attribute__((always_inline)) int32_t position_reduce(lst_t const *lst, layout_t layout,
+								      int32_t position)
+{
+	if (likely(!is_modular(layout))) return position & lst->index_mask;
+	return (position >= lst->modulus) ? position - lst->modulus : position;
+}
+
+static inline __attribute__((always_inline)) int32_t offset_reduce(lst_t const *lst, layout_t layout,
+								    int32_t offset)
+{
+	if (is_modular(layout) && offset < 0) return offset + lst->modulus;
+	return position_reduce(lst, layout, offset);
+}
+
+/*
+ * A segmented LST keeps its elements in segments of SEGMENT_SIZE, reached
+ * through a directory whose size is a power of two. Its indices are
+ * positions reduced modulo POSITION_MASK + 1 rather than modulo the
+ * capacity, and the segment holding a position is found from its number
+ * modulo the directory size. Since both moduli are powers of two, and
+ * the capacity leaves one segment spare so that no two segments in use
+ * share a directory slot, growing only has to double the directory and
+ * move the segments' pointers to their new slots; no element moves and
+ * no index changes. Segments themselves are allocated as positions come
+ * into use.
+ */
+#define SEGMENT_SHIFT		11
+#define SEGMENT_SIZE		(1 << SEGMENT_SHIFT)
+#define POSITION_MASK		((1 << 30) - 1)
+
+#define segment_slot(_lst, _index)		((index_reduce((_lst), LAYOUT_SEGMENTED, (_index)) >> SEGMENT_SHIFT) & \
+						 ((_lst)->segments - 1))
+#define segment_offset(_index)			((_index) & (SEGMENT_SIZE - 1))
+
+#define is_equivalent(_lst, _layout, _index1, _index2) \
+	(index_reduce((_lst), (_layout), (_index1)) == index_reduce((_lst), (_layout), (_index2)))
+#define item(_lst, _layout, _index)		(*(unlikely(is_segmented(_layout)) ? \
+						   &(_lst)->segment[segment_slot((_lst), (_index))][segment_offset(_index)] : \
+						   &(_lst)->p[index_reduce((_lst), (_layout), (_index))]))
+#define item_key(_lst, _layout, _index)		(*(unlikely(is_segmented(_layout)) ? \
+						   &(_lst)->key_segment[segment_slot((_lst), (_index))][segment_offset(_index)] : \
+						   &(_lst)->keys[index_reduce((_lst), (_layout), (_index))]))
+#define index_reduce(_lst, _layout, _index)	position_reduce((_lst), (_layout), (_index))
+#define pivot_item(_lst, _layout, _index)	item((_lst), (_layout), stack_item(&(_lst)->s, (_index)))
+
+/*
+ * Whether size elements from start are adjacent in memory.
+ */
+#define is_contiguous(_lst, _layout, _start, _size) \
+	(is_segmented(_layout) ? segment_offset(_start) + (_size) <= SEGMENT_SIZE : \
+				 index_reduce((_lst), (_layout), (_start)) + (_size) <= (_lst)->capacity)
+
+/*
+ * Run a statement with layout declared as a constant equal to the LST's
+ * layout. Each layout thus gets its own copy of the always inline code the
+ * statement calls, with the tests of layout compiled away, so that flat
+ * LSTs don't pay for what segmented ones need, nor those whose capacity
+ * is a power of two for what other capacities need, nor LSTs with indexes
+ * for checking whether to write them. That's done where an operation
+ * starts, and where partition() starts, since its kernels are too big to
+ * copy into every operation.
+ */
+#define LAYOUT_CASE(_layout, ...) \
+	case _layout: \
+	{ \
+		layout_t const layout = _layout; \
+		__VA_ARGS__; \
+		break; \
+	}
+
+#define LAYOUT_SPECIALIZE(_lst, ...) \
+	do { \
+		switch ((_lst)->layout) { \
+		LAYOUT_CASE(LAYOUT_FLAT, __VA_ARGS__) \
+		LAYOUT_CASE(LAYOUT_MODULAR, __VA_ARGS__) \
+		LAYOUT_CASE(LAYOUT_SEGMENTED, __VA_ARGS__) \
+		LAYOUT_CASE(LAYOUT_FLAT | LAYOUT_UNINDEXED, __VA_ARGS__) \
+		LAYOUT_CASE(LAYOUT_MODULAR | LAYOUT_UNINDEXED, __VA_ARGS__) \
+		LAYOUT_CASE(LAYOUT_SEGMENTED | LAYOUT_UNINDEXED, __VA_ARGS__) \
+		default: \
+			__builtin_unreachable(); \
+		} \
+	} while (0)
+
+/*
+ * Each LST has its own PRNG so that LSTs in different threads don't contend
+ * on the lock glibc's rand() takes. xorshift64* is plenty for choosing pivots
+ * and making flatten decisions.
+ */
+static inline __attribute__((always_inline, nonnull)) uint64_t lst_rand64(lst_t *lst)
+{
+	uint64_t	x = lst->rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	lst->rng = x;
+	return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static inline __attribute__((always_inline, nonnull)) uint32_t lst_rand(lst_t *lst)
+{
+	return lst_rand64(lst) >> 32;
+}
+
+/*
+ * Return a double uniformly distributed in [0, 1), from the top 53 bits.
+ */
+static inline __attribute__((always_inline, nonnull)) double lst_rand_unit(lst_t *lst)
+{
+	return (lst_rand64(lst) >> 11) * 0x1p-53;
+}
+
+/*
+ * Return a value in [0, n) without a division, by taking the high half of
+ * a 32x32 multiply (Lemire's multiply-shift range reduction).
+ */
+static inline __attribute__((always_inline, nonnull)) lst_index_t lst_rand_range(lst_t *lst, lst_index_t n)
+{
+	return ((uint64_t)lst_rand(lst) * (uint32_t)n) >> 32;
+}
+
+/*
+ * splitmix64, used to turn a possibly poor seed into a good, nonzero
+ * starting state.
+ */
+static uint64_t lst_seed_mix(uint64_t x)
+{
+	x += UINT64_C(0x9E3779B97F4A7C15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+	x ^= x >> 31;
+	return x ? x : UINT64_C(0x9E3779B97F4A7C15);
+}
+
 /*
  * The LST as defined in the paper has a fixed size set at creation.
  * Here, as with quickheaps, but we want to allow for expansion...
@@ -89,6 +316,78 @@ struct lst_s {
  */
 #define INITIAL_CAPACITY	2048
 #define INITIAL_STACK_CAPACITY	32
+#define GROWTH_MAX		16
+
+/*
+ * Pivot selection tuning. Below PIVOT_SAMPLE_MIN elements, sampling costs
+ * more than an unlucky split, so every policy falls back to a random pivot.
+ */
+#define PIVOT_SAMPLE_MIN	16
+#define PIVOT_SAMPLE_MAX	31
+#define DEFAULT_PIVOT_QUANTILE	25
+
+/*
+ * After this many badly skewed partitions in a row, of buckets of at
+ * least INTROSELECT_MIN elements, partition() falls back on the median of
+ * medians; see split_note().
+ */
+#define INTROSELECT_BAD_SPLITS	3
+#define INTROSELECT_MIN		64
+
+/*
+ * Once the pivot stack of an LST of n elements holds more than
+ * STACK_DEPTH_FACTOR * log2(n) + STACK_DEPTH_SLACK pivots, inserts and
+ * extracts thin it; see stack_rebalance().
+ */
+#define STACK_DEPTH_FACTOR	4
+#define STACK_DEPTH_SLACK	16
+
+/*
+ * Number of comparison outcomes the block partition buffers per side.
+ * It has to fit in the uint8_t offsets.
+ */
+#define PARTITION_BLOCK_SIZE	64
+
+/*
+ * Smallest bucket for which LSTs with keys use them to partition. Below
+ * this, setting up the keyed kernel costs more than the comparator calls.
+ */
+#ifndef KEYED_PARTITION_MIN
+#  define KEYED_PARTITION_MIN	1024
+#endif
+
+/*
+ * Multi-way partitioning. Buckets smaller than MULTIWAY_PARTITION_MIN are
+ * partitioned the ordinary way; MULTIWAY_MAX ways are the most an LST may
+ * ask for, and each splitter is picked from MULTIWAY_OVERSAMPLE sampled
+ * elements.
+ */
+#define MULTIWAY_PARTITION_MIN	4096
+#define MULTIWAY_MAX		64
+#define MULTIWAY_OVERSAMPLE	2
+
+/*
+ * Leftmost buckets this small are sorted rather than partitioned, by default.
+ */
+#define DEFAULT_SORT_THRESHOLD	32
+
+/*
+ * An insert into a sorted bucket that belongs at most this many places
+ * from its end is put there, so that nearly ascending inserts keep the
+ * bucket sorted.
+ */
+#define SORTED_INSERT_MAX	8
+
+/*
+ * How many elements ahead the partitions of LSTs with the prefetch option
+ * prefetch those they'll compare or swap; 0 compiles prefetching out.
+ * bucket_add() and bucket_delete() prefetch the elements they'll move
+ * half as many pivots ahead, since pivot stacks are seldom deep.
+ */
+#ifndef PREFETCH_DISTANCE
+#  define PREFETCH_DISTANCE	8
+#endif
+#define PREFETCH_PIVOTS		(PREFETCH_DISTANCE / 2)
 
 /*
  * The paper defines randomized priority queue operations appropriately for the
@@ -120,40 +419,79 @@ struct lst_s {
  * 2. one can fetch and modify arbitrary stack items; when array elements must be
  *    moved to keep them contiguous, the pivot stack entries must change to match.
  */
-static __attribute__((nonnull)) int stack_alloc(pivot_stack_t *s)
+static __attribute__((nonnull)) int stack_alloc(pivot_stack_t *s, stack_index_t size)
 {
-	s->data = calloc(sizeof(lst_index_t), INITIAL_STACK_CAPACITY);
+	s->data = calloc(sizeof(lst_index_t), size);
 	if (!s->data) {
 		return -1;
 	}
+	s->order = calloc(sizeof(uint8_t), size);
+	if (!s->order) {
+		free(s->data);
+		return -1;
+	}
+	s->slack = calloc(sizeof(uint8_t), size);
+	if (!s->slack) {
+		free(s->order);
+		free(s->data);
+		return -1;
+	}
+	s->key = calloc(sizeof(uint64_t), size);
+	if (!s->key) {
+		free(s->slack);
+		free(s->order);
+		free(s->data);
+		return -1;
+	}
 
 	s->depth = 0;
-	s->size = INITIAL_STACK_CAPACITY;
+	s->size = size;
 	return 0;
 }
 
 static __attribute__((nonnull)) void stack_free(pivot_stack_t *s)
 {
 	free(s->data);
+	free(s->order);
+	free(s->slack);
+	free(s->key);
 }
 
 static __attribute__((nonnull)) bool stack_expand(pivot_stack_t *s)
 {
 	lst_index_t	*n;
+	uint8_t		*n_order, *n_slack;
+	uint64_t	*n_key;
 	size_t		n_size = 2 * s->size;
 
 	n = realloc(s->data, sizeof(lst_index_t) * n_size);
 	if (unlikely(!n)) return false;
+	s->data = n;
+
+	n_order = realloc(s->order, sizeof(uint8_t) * n_size);
+	if (unlikely(!n_order)) return false;
+	s->order = n_order;
+
+	n_slack = realloc(s->slack, sizeof(uint8_t) * n_size);
+	if (unlikely(!n_slack)) return false;
+	s->slack = n_slack;
+
+	n_key = realloc(s->key, sizeof(uint64_t) * n_size);
+	if (unlikely(!n_key)) return false;
+	s->key = n_key;
 
 	s->size = n_size;
-	s->data = n;
 	return true;
 }
 
-static inline __attribute__((always_inline, nonnull)) int stack_push(pivot_stack_t *s, lst_index_t pivot)
+static inline __attribute__((always_inline, nonnull)) int stack_push(pivot_stack_t *s, lst_index_t pivot,
+								    uint64_t key)
 {
 	if (unlikely(s->depth == s->size && !stack_expand(s))) return -1;
 
+	s->order[s->depth] = BUCKET_UNORDERED;
+	s->slack[s->depth] = 0;
+	s->key[s->depth] = key;
 	s->data[s->depth++] = pivot;
 	return 0;
 }
@@ -179,305 +517,2845 @@ static inline __attribute__((always_inline, nonnull)) void stack_set(pivot_stack
 	s->data[index] = new_value;
 }
 
-lst_t *_lst_alloc(lst_cmp_t cmp, size_t offset)
+static inline __attribute__((always_inline, nonnull)) uint64_t stack_key(pivot_stack_t *s, stack_index_t index)
 {
-	lst_t	*lst;
-
-	lst = calloc(sizeof(lst_t), 1);
-	if (!lst) return NULL;
+	return s->key[index];
+}
 
-	lst->capacity = INITIAL_CAPACITY;
-	lst->p = calloc(sizeof(void *), lst->capacity);
-	if (!lst->p) {
-	cleanup:
-		free(lst);
-		return NULL;
-	}
+static inline __attribute__((always_inline, nonnull)) void stack_set_key(pivot_stack_t *s, stack_index_t index,
+								     uint64_t key)
+{
+	s->key[index] = key;
+}
 
-	if (stack_alloc(&lst->s) < 0) goto cleanup;
+/*
+ * Remove the pivot at index, merging the buckets either side of it.
+ */
+static inline __attribute__((always_inline, nonnull)) void stack_remove(pivot_stack_t *s, stack_index_t index)
+{
+	size_t	n = s->depth - index - 1;
 
-	/* Initially the LST is empty and we start at the beginning of the array */
-	stack_push(&lst->s, 0);
-	lst->idx = 0;
+	memmove(&s->data[index], &s->data[index + 1], n * sizeof(s->data[0]));
+	memmove(&s->order[index], &s->order[index + 1], n * sizeof(s->order[0]));
+	memmove(&s->slack[index], &s->slack[index + 1], n * sizeof(s->slack[0]));
+	memmove(&s->key[index], &s->key[index + 1], n * sizeof(s->key[0]));
+	s->depth--;
+}
 
-	lst->cmp = cmp;
-	lst->offset = offset;
+static inline __attribute__((always_inline, nonnull)) bucket_order_t stack_order(pivot_stack_t *s, stack_index_t index)
+{
+	return s->order[index];
+}
 
-	return lst;
+static inline __attribute__((always_inline, nonnull)) void stack_set_order(pivot_stack_t *s, stack_index_t index,
+									   bucket_order_t order)
+{
+	s->order[index] = order;
 }
 
-void lst_free(lst_t *lst)
+static inline __attribute__((always_inline, nonnull)) lst_index_t stack_slack(pivot_stack_t *s, stack_index_t index)
 {
-	stack_free(&lst->s);
-	free(lst->p);
-	free(lst);
+	return s->slack[index];
 }
 
-/*
- * The length function for LSTs (how many buckets it contains)
- */
-static inline __attribute__((always_inline, nonnull)) stack_index_t lst_length(lst_t *lst, stack_index_t stack_index)
+static inline __attribute__((always_inline, nonnull)) void stack_set_slack(pivot_stack_t *s, stack_index_t index,
+									   lst_index_t slack)
 {
-	return stack_depth(&lst->s) - stack_index;
+	s->slack[index] = slack;
 }
 
 /*
- * The size function for LSTs (number of items a (sub)tree contains)
+ * Keyed classification kernels. Given up to 64 contiguous elements, these
+ * load the elements' keys directly, rather than calling the comparator, and
+ * return a mask with bit j set if element j's key puts it on the wrong side
+ * of the pivot: for the left side, if its key is > the pivot's; for the
+ * right, if it's <. Elements whose keys equal the pivot's go in the ties
+ * mask instead, for the caller to settle with the comparator, which may
+ * order them by more than the key. As with Hoare, those the comparator
+ * finds equal are misplaced on both sides, so runs of duplicates still
+ * split evenly.
  */
-static __attribute__((nonnull)) lst_index_t lst_size(lst_t *lst, stack_index_t stack_index)
+static inline __attribute__((always_inline)) int key_cmp(lst_key_type_t type, void const *data,
+							 size_t key_offset, lst_key_t pivot)
 {
-	lst_index_t	reduced_right, reduced_idx;
+	uint8_t const	*key = (uint8_t const *)data + key_offset;
 
-	if (stack_index == 0) return lst->num_elements;
-
-	reduced_right = index_reduce(lst, stack_item(&lst->s, stack_index));
-	reduced_idx = index_reduce(lst, lst->idx);
+	switch (type) {
+	case LST_KEY_INT32:
+		return (*(int32_t const *)key > pivot.i32) - (*(int32_t const *)key < pivot.i32);
 
-	if (reduced_idx <= reduced_right) return reduced_right - reduced_idx;	/* No wraparound--easy. */
+	case LST_KEY_INT64:
+		return (*(int64_t const *)key > pivot.i64) - (*(int64_t const *)key < pivot.i64);
 
-	return (lst->capacity - reduced_idx) + reduced_right;
+	default:
+		return (*(double const *)key > pivot.d) - (*(double const *)key < pivot.d);
+	}
 }
 
-/*
- * Flatten an LST, i.e. turn it into the base-case one bucket [sub]tree
- * NOTE: so doing leaves the passed stack_index valid--we just add
- * everything once in the left subtree to it.
- */
-static inline __attribute__((always_inline, nonnull)) void lst_flatten(lst_t *lst, stack_index_t stack_index)
+static inline __attribute__((always_inline)) lst_key_t key_load(lst_key_type_t type, void const *data,
+								 size_t key_offset)
 {
-	stack_pop(&lst->s, stack_depth(&lst->s) - stack_index);
+	uint8_t const	*key = (uint8_t const *)data + key_offset;
+	lst_key_t	ret;
+
+	switch (type) {
+	case LST_KEY_INT32:
+		ret.i32 = *(int32_t const *)key;
+		break;
+
+	case LST_KEY_INT64:
+		ret.i64 = *(int64_t const *)key;
+		break;
+
+	default:
+		ret.d = *(double const *)key;
+		break;
+	}
+	return ret;
 }
 
 /*
- * Move data to a specific location in an LST's array.
- * The caller must have made sure the location is available and exists
- * in said array.
+ * Portable kernel, also used for the tails the vector kernels leave.
  */
-static inline __attribute__((always_inline, nonnull)) void lst_move(lst_t *lst, lst_index_t location, void *data)
+static uint64_t classify_scalar(void * const *in, int n, lst_key_type_t type, size_t key_offset,
+				lst_key_t pivot, bool right, uint64_t *ties)
 {
-	item(lst, location) = data;
-	item_index(lst, data) = index_reduce(lst, location);
+	uint64_t	mask = 0, equal = 0;
+
+	for (int i = 0; i < n; i++) {
+		int	cmp = key_cmp(type, in[i], key_offset, pivot);
+
+		mask |= (uint64_t)(right ? cmp < 0 : cmp > 0) << i;
+		equal |= (uint64_t)(cmp == 0) << i;
+	}
+
+	*ties = equal;
+	return mask;
 }
 
+#ifdef LST_HAVE_X86_SIMD
 /*
- * Add data to the bucket of a specified (sub)tree..
+ * Gather the keys of four elements and return a 4-bit mask of those
+ * whose keys are misplaced, setting equal to a mask of those whose keys
+ * equal the pivot's.
  */
-static void bucket_add(lst_t *lst, stack_index_t stack_index, void *data)
+static inline __attribute__((always_inline, target("avx2"))) int classify_mask_avx2(__m256i addrs, lst_key_type_t type,
+										   lst_key_t pivot, bool right, int *equal)
 {
-	lst_index_t	new_space;
+	switch (type) {
+	case LST_KEY_INT32:
+	{
+		__m128i	keys = _mm256_i64gather_epi32((int const *)0, addrs, 1);
+		__m128i	pk = _mm_set1_epi32(pivot.i32);
+
+		*equal = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(keys, pk)));
+		return _mm_movemask_ps(_mm_castsi128_ps(right ? _mm_cmpgt_epi32(pk, keys) :
+							     _mm_cmpgt_epi32(keys, pk)));
+	}
 
-	/*
-	 * For each bucket to the right, starting from the top,
-	 * make a space available at the top and move the bottom item
-	 * into it. Since ordering within a bucket doesn't matter, we
-	 * can do that, minimizing moving and index adjustment.
-	 *
-	 * The fictitious pivot doesn't correspond to an actual value,
-	 * so we save pivot moving for the end of the loop.
-	 */
-	for (stack_index_t rindex = 0; rindex < stack_index; rindex++) {
-		lst_index_t	prev_pivot_index = stack_item(&lst->s, rindex + 1);
-		bool		empty_bucket;
+	case LST_KEY_INT64:
+	{
+		__m256i	keys = _mm256_i64gather_epi64((long long const *)0, addrs, 1);
+		__m256i	pk = _mm256_set1_epi64x(pivot.i64);
 
-		new_space = stack_item(&lst->s, rindex);
-		empty_bucket = (new_space - prev_pivot_index) == 1;
-		stack_set(&lst->s, rindex, new_space + 1);
+		*equal = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(keys, pk)));
+		return _mm256_movemask_pd(_mm256_castsi256_pd(right ? _mm256_cmpgt_epi64(pk, keys) :
+								   _mm256_cmpgt_epi64(keys, pk)));
+	}
 
-		if (!empty_bucket) lst_move(lst, new_space, item(lst, prev_pivot_index + 1));
+	default:
+	{
+		__m256d	keys = _mm256_i64gather_pd((double const *)0, addrs, 1);
+		__m256d	pk = _mm256_set1_pd(pivot.d);
 
-		/* move the pivot up, leaving space for the next bucket */
-		lst_move(lst, prev_pivot_index + 1, item(lst, prev_pivot_index));
+		*equal = _mm256_movemask_pd(_mm256_cmp_pd(keys, pk, _CMP_EQ_OQ));
+		return _mm256_movemask_pd(right ? _mm256_cmp_pd(keys, pk, _CMP_LT_OQ) :
+					  _mm256_cmp_pd(keys, pk, _CMP_GT_OQ));
+	}
+	}
+}
+
+static __attribute__((target("avx2"))) uint64_t classify_avx2(void * const *in, int n, lst_key_type_t type,
+							       size_t key_offset, lst_key_t pivot, bool right,
+							       uint64_t *ties)
+{
+	__m256i		offset = _mm256_set1_epi64x(key_offset);
+	uint64_t	mask = 0, equal = 0;
+	int		i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i	ptrs = _mm256_loadu_si256((__m256i const *)&in[i]);
+		int	eq;
+
+		mask |= (uint64_t)classify_mask_avx2(_mm256_add_epi64(ptrs, offset), type, pivot, right, &eq) << i;
+		equal |= (uint64_t)eq << i;
 	}
 
 	/*
-	 * If the bucket isn't the leftmost, the above loop has made space
-	 * available where the pivot used to be.
-	 * If it is the leftmost, the loop wasn't executed, but the fictitious
-	 * pivot isn't there, which is just as good.
+	 * A full block leaves no tail, and shifting by 64 is undefined.
 	 */
-	new_space = stack_item(&lst->s, stack_index);
-	stack_set(&lst->s, stack_index, new_space + 1);
-	lst_move(lst, new_space, data);
+	if (i < n) {
+		uint64_t	tail_ties;
 
-	lst->num_elements++;
+		mask |= classify_scalar(in + i, n - i, type, key_offset, pivot, right, &tail_ties) << i;
+		equal |= tail_ties << i;
+	}
+
+	*ties = equal;
+	return mask;
 }
 
 /*
- * Reduce pivot stack indices based on their difference from lst->idx,
- * and then reduce lst->idx.
+ * As classify_avx2(), but eight elements at a time.
  */
-static void lst_indices_reduce(lst_t *lst)
+static __attribute__((target("avx512f,avx512vl"))) uint64_t classify_avx512(void * const *in, int n, lst_key_type_t type,
+									     size_t key_offset, lst_key_t pivot, bool right,
+									     uint64_t *ties)
 {
-	lst_index_t	reduced_idx = index_reduce(lst, lst->idx);
-	stack_index_t	depth = stack_depth(&lst->s);
+	__m512i		offset = _mm512_set1_epi64(key_offset);
+	uint64_t	mask = 0, equal = 0;
+	int		i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m512i		addrs = _mm512_add_epi64(_mm512_loadu_si512(&in[i]), offset);
+		__mmask8	misplaced, eq;
+
+		switch (type) {
+		case LST_KEY_INT32:
+		{
+			__m256i	keys = _mm512_i64gather_epi32(addrs, (int const *)0, 1);
+			__m256i	pk = _mm256_set1_epi32(pivot.i32);
+
+			misplaced = right ? _mm256_cmplt_epi32_mask(keys, pk) : _mm256_cmpgt_epi32_mask(keys, pk);
+			eq = _mm256_cmpeq_epi32_mask(keys, pk);
+			break;
+		}
+
+		case LST_KEY_INT64:
+		{
+			__m512i	keys = _mm512_i64gather_epi64(addrs, (long long const *)0, 1);
+			__m512i	pk = _mm512_set1_epi64(pivot.i64);
+
+			misplaced = right ? _mm512_cmplt_epi64_mask(keys, pk) : _mm512_cmpgt_epi64_mask(keys, pk);
+			eq = _mm512_cmpeq_epi64_mask(keys, pk);
+			break;
+		}
+
+		default:
+		{
+			__m512d	keys = _mm512_i64gather_pd(addrs, (double const *)0, 1);
+			__m512d	pk = _mm512_set1_pd(pivot.d);
+
+			misplaced = right ? _mm512_cmp_pd_mask(keys, pk, _CMP_LT_OQ) :
+					    _mm512_cmp_pd_mask(keys, pk, _CMP_GT_OQ);
+			eq = _mm512_cmp_pd_mask(keys, pk, _CMP_EQ_OQ);
+			break;
+		}
+		}
 
-	for (stack_index_t i = 0; i < depth; i++) {
-		stack_set(&lst->s, i, reduced_idx + stack_item(&lst->s, i) - lst->idx);
+		mask |= (uint64_t)misplaced << i;
+		equal |= (uint64_t)eq << i;
 	}
-	lst->idx = reduced_idx;
+
+	if (i < n) {
+		uint64_t	tail_ties;
+
+		mask |= classify_scalar(in + i, n - i, type, key_offset, pivot, right, &tail_ties) << i;
+		equal |= tail_ties << i;
+	}
+
+	*ties = equal;
+	return mask;
 }
+#endif
 
 /*
- * Make more space available in an LST.
- * The LST paper only mentions this option in passing, pointing out that it's O(n); the only
- * constructor in the paper lets you hand it an array of items to initially insert
- * in the LST, so elements will have to be removed to make room for more (though it's
- * easy to see how one could specify extra space).
- *
- * Were it not for the circular array optimization, it would be realloc() and done; either
- * it works or it doesn't. (That's still O(n), since it may require copying the data.)
- *
- * With the circular array optimization, if lst->idx refers to something other than the
- * beginning of the array, you have to move the elements preceding it to beginning of the
- * newly-available space so it's still contiguous, and keep pivot stack entries consistent
- * with the positions of the elements.
+ * Pick the best keyed classification kernel the CPU we're running on supports.
  */
-static bool lst_expand(lst_t *lst)
+static lst_classify_t classify_select(void)
 {
-	void 		**n;
-	size_t		n_capacity = 2 * lst->capacity;
-	lst_index_t	old_capacity = lst->capacity;
-
-	n = realloc(lst->p, sizeof(void *) * n_capacity);
-	if (unlikely(!n)) return false;
-
-	lst->p = n;
-	lst->capacity = n_capacity;
+#ifdef LST_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) return classify_avx512;
+	if (__builtin_cpu_supports("avx2")) return classify_avx2;
+#endif
+	return classify_scalar;
+}
 
-	lst_indices_reduce(lst);
+lst_t *_lst_alloc(lst_cmp_t cmp, size_t offset)
+{
+	return _lst_alloc_opts(cmp, offset, NULL);
+}
 
-	for (lst_index_t i = 0; i < lst->idx; i++) {
-		void		*to_be_moved = item(lst, i);
-		lst_index_t	new_index = item_index(lst, to_be_moved) + old_capacity;
-		lst_move(lst, new_index, to_be_moved);
-	}
+/*
+ * The capacity of a flat LST is at most ARRAY_CAPACITY_MAX, so that
+ * positions, which may reach twice it, don't overflow. That of a segmented
+ * LST is one segment short of its directory's, whose size is a power of
+ * two no greater than SEGMENTS_MAX so that positions stay distinct modulo
+ * POSITION_MASK + 1. directory_size() returns the least directory that
+ * holds n elements; callers check the limits.
+ */
+#define ARRAY_CAPACITY_MAX	(1 << 30)
+#define SEGMENTS_MAX		((POSITION_MASK + 1) / SEGMENT_SIZE)
 
-	return true;
+static lst_index_t pow2_roundup(lst_index_t n)
+{
+	return n <= 1 ? 1 : 1 << (32 - __builtin_clz(n - 1));
 }
 
-static inline __attribute__((always_inline, nonnull)) lst_index_t bucket_lwb(lst_t *lst, size_t stack_index)
+static lst_index_t directory_size(lst_index_t n)
 {
-	if (is_bucket(lst, stack_index)) return lst->idx;
-	return stack_item(&lst->s, stack_index + 1) + 1;
+	return pow2_roundup((n + SEGMENT_SIZE - 1) / SEGMENT_SIZE + 1);
 }
 
 /*
- * Note: buckets can be empty,
+ * Set the modulus positions are reduced by, and with it whether reducing
+ * them takes a conditional subtract rather than a mask.
  */
-static inline __attribute__((always_inline, nonnull)) lst_index_t bucket_upb(lst_t *lst, size_t stack_index)
+static void modulus_set(lst_t *lst, lst_index_t modulus)
 {
-	return stack_item(&lst->s, stack_index) - 1;
+	lst->modulus = modulus;
+	lst->index_mask = modulus - 1;
+	if ((modulus & (modulus - 1)) != 0) {
+		lst->layout |= LAYOUT_MODULAR;
+	} else {
+		lst->layout &= ~LAYOUT_MODULAR;
+	}
 }
 
 /*
- * Partition an LST
- * It's only called for trees that are a single nonempty bucket;
- * if it's a subtree, it is thus necessarily the leftmost.
+ * Allocate an LST's element array, and its key cache if it has one, to
+ * hold n elements.
  */
-static void partition(lst_t *lst, stack_index_t stack_index)
+static bool array_alloc(lst_t *lst, lst_index_t n)
 {
-	lst_index_t	low = bucket_lwb(lst, stack_index);
-	lst_index_t	high = bucket_upb(lst, stack_index);
-	lst_index_t	l, h;
-	lst_index_t	pivot_index;
-	void		*pivot;
-	void		*temp;
+	lst->capacity = n;
+	modulus_set(lst, n);
 
-	/*
-	 * Hoare partition doesn't do the trivial case, so catch it here.
-	 */
-	if (is_equivalent(lst, low, high)) {
-		stack_push(&lst->s, low);
-		return;
+	lst->p = calloc(sizeof(void *), lst->capacity);
+	if (!lst->p) return false;
+	if (lst->key_project) {
+		lst->keys = calloc(sizeof(uint64_t), lst->capacity);
+		if (!lst->keys) return false;
 	}
+	return true;
+}
+
+/*
+ * The same for a segmented LST, whose segments are allocated as
+ * positions come into use; see segment_reserve().
+ */
+static bool segments_alloc(lst_t *lst, lst_index_t n)
+{
+	lst->segments = directory_size(n);
+	lst->capacity = (lst->segments - 1) * SEGMENT_SIZE;
+	modulus_set(lst, POSITION_MASK + 1);
+	lst->layout |= LAYOUT_SEGMENTED;
+
+	lst->segment = calloc(lst->segments, sizeof(void **));
+	if (!lst->segment) return false;
+	if (lst->key_project) {
+		lst->key_segment = calloc(lst->segments, sizeof(uint64_t *));
+		if (!lst->key_segment) return false;
+	}
+	return true;
+}
+
+static void segments_free(lst_t *lst)
+{
+	for (lst_index_t i = 0; lst->segment && i < lst->segments; i++) free(lst->segment[i]);
+	for (lst_index_t i = 0; lst->key_segment && i < lst->segments; i++) free(lst->key_segment[i]);
+	free(lst->segment);
+	free(lst->key_segment);
+}
+
+lst_t *_lst_alloc_opts(lst_cmp_t cmp, size_t offset, lst_opts_t const *opts)
+{
+	lst_t	*lst;
+
+	lst = calloc(sizeof(lst_t), 1);
+	if (!lst) return NULL;
+
+	if (stack_alloc(&lst->s, (opts && opts->stack_capacity > 0) ? opts->stack_capacity : INITIAL_STACK_CAPACITY) < 0) {
+	cleanup:
+		free(lst);
+		return NULL;
+	}
+
+	/* Initially the LST is empty and we start at the beginning of the array */
+	stack_push(&lst->s, 0, 0);
+	lst->idx = 0;
+
+	lst->cmp = cmp;
+	lst->offset = offset;
+	if (offset == LST_NO_INDEX) lst->layout |= LAYOUT_UNINDEXED;
+
+	lst->sort_threshold = DEFAULT_SORT_THRESHOLD;
+	lst->min_capacity = INITIAL_CAPACITY;
+	lst->growth = 2;
+	if (opts) {
+		if (opts->sort_threshold) lst->sort_threshold = (opts->sort_threshold < 0) ? 0 : opts->sort_threshold;
+		lst->pivot_policy = opts->pivot_policy;
+		lst->pivot_quantile = opts->pivot_quantile;
+		lst->partition = opts->partition;
+		lst->key_type = opts->key_type;
+		lst->key_offset = opts->key_offset;
+		lst->preserve_pivots = opts->preserve_pivots;
+		lst->shrink = opts->shrink;
+		lst->prefetch = opts->prefetch;
+		if (opts->initial_capacity > 0) lst->min_capacity = opts->initial_capacity;
+		if (opts->growth > 1) lst->growth = (opts->growth > GROWTH_MAX) ? GROWTH_MAX : opts->growth;
+
+		/*
+		 * Moving the tombstone writes its index, like any element's,
+		 * so it needs room for one. LSTs without indexes never
+		 * extract, so only need one for bucket slack.
+		 */
+		if (opts->lazy_delete > 0 && is_indexed(lst->layout)) {
+			lst->lazy_delete = opts->lazy_delete > 1 ? 1 : opts->lazy_delete;
+		}
+		lst->bucket_slack = opts->bucket_slack;
+		if (lst->lazy_delete > 0 || lst->bucket_slack > 0) {
+			lst->tombstone = calloc(1, tombstone_size(lst));
+			if (!lst->tombstone) {
+				stack_free(&lst->s);
+				goto cleanup;
+			}
+		}
+		lst->key_project = opts->key_project;
+
+		/*
+		 * The tree wants a power of two number of ways. The scatter
+		 * doesn't carry cached keys along.
+		 */
+		if (opts->multiway >= 4 && !lst->key_project) {
+			lst->multiway = (opts->multiway > MULTIWAY_MAX) ? MULTIWAY_MAX :
+					1 << (31 - __builtin_clz(opts->multiway));
+		}
+	}
+
+	/*
+	 * Capacities are rounded up, so the LST never shrinks below the one
+	 * it starts with.
+	 */
+	if (lst->min_capacity > ((opts && opts->segmented) ? (SEGMENTS_MAX - 1) * SEGMENT_SIZE : ARRAY_CAPACITY_MAX) ||
+	    !(opts && opts->segmented ? segments_alloc(lst, lst->min_capacity) : array_alloc(lst, lst->min_capacity))) {
+		free(lst->keys);
+		free(lst->p);
+		segments_free(lst);
+		free(lst->tombstone);
+		stack_free(&lst->s);
+		goto cleanup;
+	}
+	lst->min_capacity = lst->capacity;
+
+	lst->classify = classify_select();
+	if (lst->pivot_quantile == 0 || lst->pivot_quantile > 99) lst->pivot_quantile = DEFAULT_PIVOT_QUANTILE;
+
+	/*
+	 * Unless asked to be reproducible, seed from the OS's entropy, so
+	 * that nobody feeding the LST keys can predict its pivots. Failing
+	 * that, mix the time with the LST's address so that LSTs allocated
+	 * together at least don't share a sequence.
+	 */
+	if (opts && opts->deterministic) {
+		lst->rng = lst_seed_mix(opts->seed);
+	} else {
+		uint64_t	seed;
+
+		if (getentropy(&seed, sizeof(seed)) < 0) seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)lst;
+		lst->rng = lst_seed_mix(seed);
+	}
+
+	return lst;
+}
+
+void lst_free(lst_t *lst)
+{
+	free(lst->scratch);
+	free(lst->oracle);
+	stack_free(&lst->s);
+	free(lst->keys);
+	free(lst->tombstone);
+	free(lst->p);
+	segments_free(lst);
+	free(lst);
+}
+
+/*
+ * The length function for LSTs (how many buckets it contains)
+ */
+static inline __attribute__((always_inline, nonnull)) stack_index_t lst_length(lst_t *lst, stack_index_t stack_index)
+{
+	return stack_depth(&lst->s) - stack_index;
+}
+
+/*
+ * The size function for LSTs (number of items a (sub)tree contains)
+ */
+static inline __attribute__((always_inline, nonnull)) lst_index_t lst_size(lst_t *lst, layout_t layout,
+									  stack_index_t stack_index)
+{
+	if (stack_index == 0) return lst->num_elements;
+
+	return offset_reduce(lst, layout, stack_item(&lst->s, stack_index) - lst->idx);
+}
+
+/*
+ * Flatten an LST, i.e. turn it into the base-case one bucket [sub]tree
+ * NOTE: so doing leaves the passed stack_index valid--we just add
+ * everything once in the left subtree to it.
+ */
+static inline __attribute__((always_inline, nonnull)) void lst_flatten(lst_t *lst, stack_index_t stack_index)
+{
+	stack_pop(&lst->s, stack_depth(&lst->s) - stack_index);
+	stack_set_order(&lst->s, stack_index - 1, BUCKET_UNORDERED);
+}
+
+/*
+ * Not in the paper: bounding the depth of the pivot stack. Each pivot
+ * costs bucket_add() and bucket_delete() a move, and a run of skewed
+ * partitions, or inserts and extracts that keep splitting the same few
+ * buckets, can leave hundreds of pivots with a handful of elements
+ * between them. Flattening would throw away every pivot and leave the
+ * next pop to partition all n elements again; instead, we keep a pivot
+ * set like the one the paper's analysis expects, in one pass from the
+ * bottom of the stack, keeping each pivot with at most half as many
+ * elements to its left as the last one kept. No elements move. A bucket
+ * that merges others is sorted if they all were, since the dropped
+ * pivots separated them, and otherwise unordered.
+ */
+static inline __attribute__((always_inline, nonnull)) bool stack_too_deep(lst_t *lst)
+{
+	int	log2_n = lst->num_elements > 1 ? 31 - __builtin_clz(lst->num_elements) : 0;
+
+	return (stack_index_t)stack_depth(&lst->s) - 1 > STACK_DEPTH_FACTOR * log2_n + STACK_DEPTH_SLACK;
+}
+
+static __attribute__((nonnull)) void stack_rebalance(lst_t *lst)
+{
+	pivot_stack_t	*s = &lst->s;
+	stack_index_t	depth = stack_depth(s);
+	stack_index_t	kept = 1, clean_from = 0;
+	stack_index_t	dirty = lst->clean_from < depth ? lst->clean_from : depth;
+	lst_index_t	limit = lst->num_elements;
+	bool		ordered = stack_order(s, 0) != BUCKET_UNORDERED, merged = false;
+	layout_t	layout = lst->layout;
+
+	for (stack_index_t stack_index = 1; stack_index <= depth; stack_index++) {
+		lst_index_t	left = 0;
+
+		/*
+		 * The bucket below this pivot goes into the one below the
+		 * last pivot kept.
+		 */
+		if (stack_index == dirty) clean_from = kept;
+		if (stack_index < depth) {
+			left = lst_size(lst, layout, stack_index);
+			if (left > limit / 2) {
+				ordered &= stack_order(s, stack_index) != BUCKET_UNORDERED;
+				merged = true;
+				continue;
+			}
+		}
+
+		if (merged) stack_set_order(s, kept - 1, ordered ? BUCKET_SORTED : BUCKET_UNORDERED);
+		if (stack_index == depth) break;
+
+		s->data[kept] = s->data[stack_index];
+		s->key[kept] = s->key[stack_index];
+		s->order[kept] = s->order[stack_index];
+		s->slack[kept] = s->slack[stack_index];
+		ordered = stack_order(s, kept) != BUCKET_UNORDERED;
+		merged = false;
+		limit = left;
+		kept++;
+	}
+
+	s->depth = kept;
+	lst->clean_from = clean_from;
+	lst->rebalances++;
+}
+
+/*
+ * Move data to a specific location in an LST's array.
+ * The caller must have made sure the location is available and exists
+ * in said array.
+ */
+static inline __attribute__((always_inline, nonnull)) void lst_move(lst_t *lst, layout_t layout, lst_index_t location,
+								   void *data)
+{
+	item(lst, layout, location) = data;
+	if (is_indexed(layout)) item_index(lst, data) = index_reduce(lst, layout, location);
+}
+
+/*
+ * Not in the paper: prefetching, for LSTs too big for the cache. Each of
+ * these does nothing unless prefetch is set, which callers copy from
+ * lst->prefetch once, since stores through element pointers and comparator
+ * calls would have the compiler load it again every time.
+ *
+ * prefetch_index() prefetches the element at a location for writing its
+ * index. The array slot holding its pointer had best be in cache already,
+ * since reading that stalls; prefetch_slot() fetches it, and its cached
+ * key, a stage earlier.
+ */
+static inline __attribute__((always_inline, nonnull)) void prefetch_index(lst_t *lst, bool prefetch, layout_t layout,
+									  lst_index_t location)
+{
+	if (PREFETCH_DISTANCE > 0 && prefetch && is_indexed(layout)) {
+		__builtin_prefetch(index_addr(lst, item(lst, layout, location)), 1);
+	}
+}
+
+static inline __attribute__((always_inline, nonnull)) void prefetch_slot(lst_t *lst, bool prefetch, bool cached,
+									 layout_t layout, lst_index_t location)
+{
+	if (PREFETCH_DISTANCE == 0 || !prefetch) return;
+	__builtin_prefetch(&item(lst, layout, location), 1);
+	if (cached) __builtin_prefetch(&item_key(lst, layout, location), 1);
+}
+
+/*
+ * Prefetch the element at a location, if it's in [low, high], for the
+ * comparator to read. Partitions by cached keys seldom call it, so
+ * shouldn't prefetch.
+ */
+static inline __attribute__((always_inline, nonnull)) void prefetch_compare(lst_t *lst, bool prefetch, layout_t layout,
+									    lst_index_t location, lst_index_t low,
+									    lst_index_t high)
+{
+	if (PREFETCH_DISTANCE > 0 && prefetch && location >= low && location <= high) {
+		__builtin_prefetch(item(lst, layout, location), 0);
+	}
+}
+
+/*
+ * LSTs that cache keys must move an element's key along with it, so
+ * everything that moves elements other than to and from the scratch array
+ * does so with these: lst_place() puts data, whose key is key, at a
+ * location, and lst_copy() moves the element at one location to another.
+ *
+ * cached says whether the LST caches keys. The hot paths are specialized
+ * on it, passing a constant so that the test compiles away; elsewhere,
+ * callers test lst->key_project once, since the comparator calls and the stores
+ * through element pointers keep the compiler from hoisting it out of loops.
+ * layout is passed the same way, and elsewhere read once from lst->layout.
+ */
+static inline __attribute__((always_inline, nonnull)) void lst_place(lst_t *lst, bool cached, layout_t layout,
+								   lst_index_t location, void *data, uint64_t key)
+{
+	if (cached) item_key(lst, layout, location) = key;
+	lst_move(lst, layout, location, data);
+}
+
+static inline __attribute__((always_inline, nonnull)) void lst_copy(lst_t *lst, bool cached, layout_t layout,
+								  lst_index_t location, lst_index_t from)
+{
+	if (cached) item_key(lst, layout, location) = item_key(lst, layout, from);
+	lst_move(lst, layout, location, item(lst, layout, from));
+}
+
+/*
+ * The cached key of the element at a location, or zero if there isn't one.
+ */
+static inline __attribute__((always_inline, nonnull)) uint64_t location_key(lst_t *lst, bool cached, layout_t layout,
+									   lst_index_t location)
+{
+	return cached ? item_key(lst, layout, location) : 0;
+}
+
+/*
+ * Compare the element at a location with data, whose key is key if cached.
+ * Only if the keys are equal, and the two aren't the same element, as when
+ * a partition meets its pivot, does that take the comparator.
+ */
+static inline __attribute__((always_inline, nonnull)) int item_cmp(lst_t *lst, bool cached, layout_t layout,
+								   lst_index_t location, void *data, uint64_t key)
+{
+	if (cached) {
+		uint64_t	location_key = item_key(lst, layout, location);
+
+		if (location_key != key) return (location_key > key) - (location_key < key);
+		if (item(lst, layout, location) == data) return 0;
+	}
+	return lst->cmp(item(lst, layout, location), data);
+}
+
+static inline __attribute__((always_inline, nonnull)) lst_index_t bucket_lwb(lst_t *lst, size_t stack_index)
+{
+	if (is_bucket(lst, stack_index)) return lst->idx;
+	return stack_item(&lst->s, stack_index + 1) + 1;
+}
+
+/*
+ * Note: buckets can be empty,
+ */
+static inline __attribute__((always_inline, nonnull)) lst_index_t bucket_upb(lst_t *lst, size_t stack_index)
+{
+	return stack_item(&lst->s, stack_index) - 1;
+}
+
+/*
+ * Exchange the elements at two locations in an LST's array.
+ *
+ * The partitions could exchange elements in the array alone and write
+ * their indices afterwards, in prefetched batches, but Hoare and block
+ * partitions move each misplaced element just once, and writing its
+ * index then, often to a line the comparator has just read, is cheaper
+ * than coming back to it: deferring the writes made the cycle's extract
+ * stage 10% to 20% slower with each kernel, with or without cached keys,
+ * at lst_bench's default 1.6M elements and at 10M. heap_vs_lst.md has
+ * the numbers.
+ */
+static inline __attribute__((always_inline, nonnull)) void lst_swap(lst_t *lst, bool cached, layout_t layout,
+								  lst_index_t a, lst_index_t b)
+{
+	void		*temp = item(lst, layout, a);
+	uint64_t	temp_key = location_key(lst, cached, layout, a);
+
+	lst_copy(lst, cached, layout, a, b);
+	lst_place(lst, cached, layout, b, temp, temp_key);
+}
+
+/*
+ * Not in the paper: data belongs well inside the sorted leftmost bucket,
+ * whose elements from high + 1 on are all greater than it. Rather than
+ * lose the order of a bucket too big to cheaply sort again, make the first
+ * element greater than data a pivot, so that the elements before it are a
+ * sorted leftmost bucket data can go at the end of.
+ */
+static bool bucket_split(lst_t *lst, stack_index_t stack_index, lst_index_t low, lst_index_t high,
+			 void *data, uint64_t key)
+{
+	lst_index_t	pivot_index;
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+
+	if (!is_bucket(lst, stack_index) || lst_size(lst, layout, stack_index) <= lst->sort_threshold) return false;
+
+	high++;
+	while (low < high) {
+		lst_index_t	mid = low + (high - low) / 2;
+
+		if (item_cmp(lst, cached, layout, mid, data, key) > 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	pivot_index = low;
+
+	if (stack_push(&lst->s, pivot_index, location_key(lst, cached, layout, pivot_index)) < 0) return false;
+	stack_set_order(&lst->s, stack_index + 1, BUCKET_SORTED);
+	return true;
+}
+
+/*
+ * Move lst->idx and the pivot stack's positions by delta.
+ */
+static void lst_indices_shift(lst_t *lst, lst_index_t delta)
+{
+	stack_index_t	depth = stack_depth(&lst->s);
+
+	for (stack_index_t i = 0; i < depth; i++) stack_set(&lst->s, i, stack_item(&lst->s, i) + delta);
+	lst->idx += delta;
+}
+
+/*
+ * Reduce pivot stack indices based on their difference from lst->idx,
+ * and then reduce lst->idx.
+ */
+static void lst_indices_reduce(lst_t *lst)
+{
+	lst_indices_shift(lst, index_reduce(lst, lst->layout, lst->idx) - lst->idx);
+}
+
+/*
+ * Add data, whose key is key if cached, at the front of a bucket, making
+ * room there by moving the buckets to its left down into the gap below
+ * lst->idx: for each, starting from the leftmost, move the top item into
+ * the space below the bucket, and the pivot into the space that leaves.
+ * A sorted leftmost bucket moves wholesale instead, since pops depend on
+ * its order.
+ */
+static inline __attribute__((always_inline, nonnull)) void bucket_add_front(lst_t *lst, stack_index_t stack_index,
+									    void *data, uint64_t key, bool cached,
+									    layout_t layout, bucket_order_t order)
+{
+	stack_index_t	top = stack_depth(&lst->s) - 1;
+	lst_index_t	new_space;
+	bool		prefetch = lst->prefetch;
+
+	/*
+	 * Positions mustn't go negative, so the elements' stay a modulus up.
+	 */
+	if (lst->idx == 0) lst_indices_shift(lst, lst->modulus);
+	new_space = lst->idx - 1;
+
+	for (stack_index_t lindex = top; lindex > stack_index; lindex--) {
+		lst_index_t	pivot_index = stack_item(&lst->s, lindex);
+
+		if (prefetch && lindex - 2 * PREFETCH_PIVOTS > stack_index) {
+			prefetch_slot(lst, prefetch, cached, layout, stack_item(&lst->s, lindex - 2 * PREFETCH_PIVOTS) - 1);
+		}
+		if (prefetch && lindex - PREFETCH_PIVOTS > stack_index) {
+			prefetch_index(lst, prefetch, layout, stack_item(&lst->s, lindex - PREFETCH_PIVOTS) - 1);
+			prefetch_index(lst, prefetch, layout, stack_item(&lst->s, lindex - PREFETCH_PIVOTS));
+		}
+
+		if (lindex == top && stack_order(&lst->s, top) == BUCKET_SORTED) {
+			for (; new_space < pivot_index - 1; new_space++) lst_copy(lst, cached, layout, new_space, new_space + 1);
+		} else if (new_space < pivot_index - 1) {
+			lst_copy(lst, cached, layout, new_space, pivot_index - 1);
+			if (stack_order(&lst->s, lindex) == BUCKET_SORTED) stack_set_order(&lst->s, lindex, BUCKET_UNORDERED);
+		}
+
+		/* move the pivot down, leaving space for the next bucket */
+		lst_copy(lst, cached, layout, pivot_index - 1, pivot_index);
+		stack_set(&lst->s, lindex, pivot_index - 1);
+		new_space = pivot_index;
+	}
+	lst->idx--;
+	lst_place(lst, cached, layout, new_space, data, key);
+	stack_set_order(&lst->s, stack_index, order);
+
+	lst->num_elements++;
+}
+
+/*
+ * Not in the paper: bucket slack. With bucket_slack set, an insert that
+ * has to move other buckets to make room in one moves them bucket_slack
+ * places further, which costs each at most that many more element moves
+ * but no more pivot moves, and leaves the extra slots at the top of the
+ * bucket as tombstones. The stack notes how many, and the next inserts
+ * into the bucket each fill one, moving nothing. Since the slots are the
+ * tombstones lazy deletion leaves, pops, iteration and compaction already
+ * see past them.
+ *
+ * Other moves can shift tombstones about within their buckets, so the
+ * count is only a hint, checked before each use: a slot is filled only if
+ * it holds a tombstone and is inside the bucket. Those a stale count
+ * loses wait for their bucket to become the leftmost, or for
+ * lst_compact().
+ */
+static inline __attribute__((always_inline, nonnull)) bool bucket_fill_slack(lst_t *lst, stack_index_t stack_index,
+									     void *data, uint64_t key, bool cached,
+									     layout_t layout)
+{
+	lst_index_t	slack = stack_slack(&lst->s, stack_index);
+	lst_index_t	at = stack_item(&lst->s, stack_index) - slack;
+
+	if (slack == 0) return false;
+	if (at <= stack_item(&lst->s, stack_index + 1) || item(lst, layout, at) != lst->tombstone ||
+	    stack_order(&lst->s, stack_index) != BUCKET_UNORDERED) {
+		stack_set_slack(&lst->s, stack_index, 0);
+		return false;
+	}
+
+	lst_place(lst, cached, layout, at, data, key);
+	stack_set_slack(&lst->s, stack_index, slack - 1);
+	lst->tombstones--;
+	return true;
+}
+
+/*
+ * Add data to a bucket other than the leftmost and rightmost, making room
+ * slots there by moving the buckets between it and the nearer end of the
+ * array room places at once. Each moves at most room elements from one end
+ * to the other, then its pivot; a sorted leftmost bucket moves wholesale,
+ * as in bucket_add_front(). data goes in the lowest of the new slots, and
+ * tombstones in the rest, which are left at the top of the bucket.
+ */
+static __attribute__((nonnull)) void bucket_add_slack(lst_t *lst, stack_index_t stack_index, void *data, uint64_t key,
+						      lst_index_t room)
+{
+	stack_index_t	top = stack_depth(&lst->s) - 1;
+	lst_index_t	front_cost = top - stack_index;
+	lst_index_t	low, high, n, moved;
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+
+	if (stack_order(&lst->s, top) == BUCKET_SORTED) front_cost += lst_size(lst, layout, top);
+
+	if (front_cost < stack_index) {
+		/*
+		 * Positions mustn't go negative, so the elements' stay a modulus up.
+		 */
+		if (lst->idx < room) lst_indices_shift(lst, lst->modulus);
+		low = lst->idx - 1;
+		lst->idx -= room;
+
+		for (stack_index_t lindex = top; lindex > stack_index; lindex--) {
+			high = stack_item(&lst->s, lindex);
+			n = high - low - 1;
+			if (lindex == top && n > room && stack_order(&lst->s, top) == BUCKET_SORTED) {
+				for (lst_index_t i = low + 1; i < high; i++) lst_copy(lst, cached, layout, i - room, i);
+			} else {
+				moved = n < room ? n : room;
+				for (lst_index_t i = 0; i < moved; i++) {
+					lst_copy(lst, cached, layout, low - room + 1 + i, high - moved + i);
+				}
+				if (n > room && stack_order(&lst->s, lindex) == BUCKET_SORTED) {
+					stack_set_order(&lst->s, lindex, BUCKET_UNORDERED);
+				}
+			}
+			lst_copy(lst, cached, layout, high - room, high);
+			stack_set(&lst->s, lindex, high - room);
+			low = high;
+		}
+
+		/*
+		 * The free slots are at the bottom of the bucket; move elements
+		 * from its top down to leave all but one of them there.
+		 */
+		high = stack_item(&lst->s, stack_index);
+		n = high - low - 1;
+		moved = n < room - 1 ? n : room - 1;
+		for (lst_index_t i = 0; i < moved; i++) lst_copy(lst, cached, layout, low - room + 1 + i, high - moved + i);
+		lst_place(lst, cached, layout, low - room + 1 + moved, data, key);
+	} else {
+		stack_set(&lst->s, 0, stack_item(&lst->s, 0) + room);
+		for (stack_index_t rindex = 0; rindex < stack_index; rindex++) {
+			low = stack_item(&lst->s, rindex + 1);
+			high = stack_item(&lst->s, rindex) - room;
+			n = high - low - 1;
+			moved = n < room ? n : room;
+			for (lst_index_t i = 0; i < moved; i++) {
+				lst_copy(lst, cached, layout, high + room - moved + i, low + 1 + i);
+			}
+			if (n > room && stack_order(&lst->s, rindex) == BUCKET_SORTED) {
+				stack_set_order(&lst->s, rindex, BUCKET_UNORDERED);
+			}
+			lst_copy(lst, cached, layout, low + room, low);
+			stack_set(&lst->s, rindex + 1, low + room);
+		}
+		lst_place(lst, cached, layout, stack_item(&lst->s, stack_index) - room, data, key);
+	}
+
+	high = stack_item(&lst->s, stack_index);
+	for (lst_index_t i = 1; i < room; i++) item(lst, layout, high - i) = lst->tombstone;
+	stack_set_order(&lst->s, stack_index, BUCKET_UNORDERED);
+	stack_set_slack(&lst->s, stack_index, room - 1);
+	if (stack_index >= lst->clean_from) lst->clean_from = stack_index + 1;
+	lst->tombstones += room - 1;
+	lst->num_elements += room;
+}
+
+/*
+ * Add data, whose key is key if cached, to the bucket of a specified (sub)tree..
+ */
+static inline __attribute__((always_inline, nonnull)) void bucket_add(lst_t *lst, stack_index_t stack_index,
+								     void *data, uint64_t key, bool cached,
+								     layout_t layout)
+{
+	stack_index_t	top = stack_depth(&lst->s) - 1;
+	lst_index_t	lwb = bucket_lwb(lst, stack_index), upb = bucket_upb(lst, stack_index);
+	lst_index_t	new_space;
+	lst_index_t	shift = 0;
+	bucket_order_t	order = BUCKET_UNORDERED;
+	bool		front = false;
+	bool		prefetch = lst->prefetch;
+
+	/*
+	 * Not in the paper: notice ascending inserts. An empty bucket is
+	 * trivially sorted, and a sorted bucket stays sorted if data goes
+	 * at or near its end; otherwise adding to a bucket loses what we
+	 * know about its order. Note whether data can go at the front of
+	 * the bucket instead, which is as good unless the bucket is sorted.
+	 */
+	if (upb < lwb) {
+		order = BUCKET_SORTED;
+		front = true;
+	} else if (stack_order(&lst->s, stack_index) == BUCKET_SORTED) {
+		while (shift <= SORTED_INSERT_MAX && upb - shift >= lwb &&
+		       item_cmp(lst, cached, layout, upb - shift, data, key) > 0) shift++;
+
+		if (shift <= SORTED_INSERT_MAX) {
+			order = BUCKET_SORTED;
+			front = upb - shift < lwb;
+		} else if (stack_index == top && item_cmp(lst, cached, layout, lwb, data, key) >= 0) {
+			shift = 0;
+			order = BUCKET_SORTED;
+			front = true;
+		} else {
+			shift = 0;
+			if (bucket_split(lst, stack_index, lwb, upb - SORTED_INSERT_MAX - 1, data, key)) {
+				stack_index++;
+				top++;
+				order = BUCKET_SORTED;
+			}
+		}
+	} else {
+		front = true;
+	}
+
+	if (lst->bucket_slack > 0 && order == BUCKET_UNORDERED && stack_index > 0 && stack_index < top) {
+		lst_index_t	room = lst->capacity - lst->num_elements;
+
+		if (bucket_fill_slack(lst, stack_index, data, key, cached, layout)) return;
+		if (room > lst->bucket_slack) room = lst->bucket_slack + 1;
+		if (room > 1) {
+			bucket_add_slack(lst, stack_index, data, key, room);
+			return;
+		}
+	}
+
+	/*
+	 * Not in the paper: the circular array's free space is a gap at the
+	 * left end as well as the right, so a bucket can make room by moving
+	 * the buckets to its left one position down rather than those to its
+	 * right one position up. For the leftmost bucket that's free, and in
+	 * general it's cheaper for buckets nearer the head, which is where
+	 * timers and searches do most of their inserts.
+	 */
+	if (front) {
+		lst_index_t	cost = top - stack_index;
+
+		if (stack_index < top && stack_order(&lst->s, top) == BUCKET_SORTED) cost += lst_size(lst, layout, top);
+		if (cost < stack_index || (cost == stack_index && (stack_index > 0 || order == BUCKET_SORTED))) {
+			bucket_add_front(lst, stack_index, data, key, cached, layout, order);
+			return;
+		}
+	}
+
+	/*
+	 * For each bucket to the right, starting from the top,
+	 * make a space available at the top and move the bottom item
+	 * into it. Since ordering within a bucket doesn't matter, we
+	 * can do that, minimizing moving and index adjustment.
+	 *
+	 * The fictitious pivot doesn't correspond to an actual value,
+	 * so we save pivot moving for the end of the loop.
+	 */
+	for (stack_index_t rindex = 0; rindex < stack_index; rindex++) {
+		lst_index_t	prev_pivot_index = stack_item(&lst->s, rindex + 1);
+		bool		empty_bucket;
+
+		if (prefetch && rindex + 2 * PREFETCH_PIVOTS < stack_index) {
+			prefetch_slot(lst, prefetch, cached, layout, stack_item(&lst->s, rindex + 2 * PREFETCH_PIVOTS + 1));
+		}
+		if (prefetch && rindex + PREFETCH_PIVOTS < stack_index) {
+			prefetch_index(lst, prefetch, layout, stack_item(&lst->s, rindex + PREFETCH_PIVOTS + 1));
+			prefetch_index(lst, prefetch, layout, stack_item(&lst->s, rindex + PREFETCH_PIVOTS + 1) + 1);
+		}
+
+		new_space = stack_item(&lst->s, rindex);
+		empty_bucket = (new_space - prev_pivot_index) == 1;
+		stack_set(&lst->s, rindex, new_space + 1);
+
+		if (!empty_bucket) {
+			lst_copy(lst, cached, layout, new_space, prev_pivot_index + 1);
+			if (stack_order(&lst->s, rindex) == BUCKET_SORTED) stack_set_order(&lst->s, rindex, BUCKET_UNORDERED);
+		}
+
+		/* move the pivot up, leaving space for the next bucket */
+		lst_copy(lst, cached, layout, prev_pivot_index + 1, prev_pivot_index);
+	}
+
+	/*
+	 * If the bucket isn't the leftmost, the above loop has made space
+	 * available where the pivot used to be.
+	 * If it is the leftmost, the loop wasn't executed, but the fictitious
+	 * pivot isn't there, which is just as good.
+	 */
+	new_space = stack_item(&lst->s, stack_index);
+	stack_set(&lst->s, stack_index, new_space + 1);
+	for (; shift > 0; shift--, new_space--) lst_copy(lst, cached, layout, new_space, new_space - 1);
+	lst_place(lst, cached, layout, new_space, data, key);
+	stack_set_order(&lst->s, stack_index, order);
+
+	lst->num_elements++;
+}
+
+/*
+ * An LST with the shrink option shrinks once fewer than an eighth of its
+ * slots are in use, to the least capacity holding twice its elements.
+ * That leaves at least a quarter of the new slots in use and half of them
+ * free, so between any shrink and the next resize, in either direction,
+ * come O(capacity) inserts or removals.
+ */
+static void shrink_threshold_set(lst_t *lst)
+{
+	lst->shrink_at = (lst->shrink && lst->capacity > lst->min_capacity) ? lst->capacity / 8 : 0;
+}
+
+/*
+ * Enlarge a segmented LST's directories to n_segments slots. The segments
+ * from the one holding lst->idx on keep their positions, so each just
+ * moves to the slot its number picks out in the larger directories; no
+ * element moves, no index changes, and the new slots get segments only
+ * as they come into use.
+ */
+static bool segments_expand(lst_t *lst, lst_index_t n_segments)
+{
+	lst_index_t	first = index_reduce(lst, LAYOUT_SEGMENTED, lst->idx) >> SEGMENT_SHIFT;
+	void		***n_segment;
+	uint64_t	**n_key_segment = NULL;
+
+	n_segment = calloc(n_segments, sizeof(void **));
+	if (!n_segment) return false;
+	if (lst->key_segment) {
+		n_key_segment = calloc(n_segments, sizeof(uint64_t *));
+		if (!n_key_segment) {
+			free(n_segment);
+			return false;
+		}
+	}
+
+	for (lst_index_t i = 0; i < lst->segments; i++) {
+		lst_index_t	slot = (first + i) & (lst->segments - 1), n_slot = (first + i) & (n_segments - 1);
+
+		n_segment[n_slot] = lst->segment[slot];
+		if (n_key_segment) n_key_segment[n_slot] = lst->key_segment[slot];
+	}
+
+	free(lst->segment);
+	free(lst->key_segment);
+	lst->segment = n_segment;
+	lst->key_segment = n_key_segment;
+	lst->segments = n_segments;
+	lst->capacity = (n_segments - 1) * SEGMENT_SIZE;
+	shrink_threshold_set(lst);
+	return true;
+}
+
+/*
+ * Make sure a segmented LST has a segment for a position. A segment left
+ * behind as lst->idx advances keeps its slot, and is reused when later
+ * positions come round to it.
+ */
+static bool segment_reserve(lst_t *lst, lst_index_t position)
+{
+	lst_index_t	slot = segment_slot(lst, position);
+
+	if (lst->segment[slot]) return true;
+
+	lst->segment[slot] = malloc(SEGMENT_SIZE * sizeof(void *));
+	if (!lst->segment[slot]) return false;
+	if (lst->key_segment) {
+		lst->key_segment[slot] = malloc(SEGMENT_SIZE * sizeof(uint64_t));
+		if (!lst->key_segment[slot]) {
+			free(lst->segment[slot]);
+			lst->segment[slot] = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Make more space available in an LST.
+ * The LST paper only mentions this option in passing, pointing out that it's O(n); the only
+ * constructor in the paper lets you hand it an array of items to initially insert
+ * in the LST, so elements will have to be removed to make room for more (though it's
+ * easy to see how one could specify extra space).
+ *
+ * Were it not for the circular array optimization, it would be realloc() and done; either
+ * it works or it doesn't. (That's still O(n), since it may require copying the data.)
+ *
+ * With the circular array optimization, if lst->idx refers to something other than the
+ * beginning of the array, you have to move the elements preceding it to beginning of the
+ * newly-available space so it's still contiguous, and keep pivot stack entries consistent
+ * with the positions of the elements.
+ *
+ * Here the LST is made to hold at least size elements, more than it can now.
+ */
+static bool lst_expand(lst_t *lst, lst_index_t size)
+{
+	void 		**n;
+	lst_index_t	n_capacity, old_capacity = lst->capacity, delta, wrapped;
+	bool		cached = lst->key_project != NULL;
+
+	if (lst->segment) {
+		if (size > (SEGMENTS_MAX - 1) * SEGMENT_SIZE) return false;
+		return segments_expand(lst, directory_size(size));
+	}
+
+	if (size > ARRAY_CAPACITY_MAX) return false;
+	n_capacity = size;
+	delta = n_capacity - old_capacity;
+
+	n = realloc(lst->p, sizeof(void *) * n_capacity);
+	if (unlikely(!n)) return false;
+
+	lst->p = n;
+
+	if (cached) {
+		uint64_t	*n_keys = realloc(lst->keys, sizeof(uint64_t) * n_capacity);
+
+		/*
+		 * Nothing has moved yet, so the LST is still usable at its old
+		 * capacity; the larger element array just goes unused.
+		 */
+		if (unlikely(!n_keys)) return false;
+		lst->keys = n_keys;
+	}
+	lst_indices_reduce(lst);
+	wrapped = lst->idx + lst->num_elements - old_capacity;
+	lst->capacity = n_capacity;
+	modulus_set(lst, n_capacity);
+	shrink_threshold_set(lst);
+
+	/*
+	 * If the elements wrap around the old end of the array, either those
+	 * at the start of the array move up past it, or those from lst->idx on
+	 * move to the new end, whichever are fewer; inserts at the leftmost
+	 * bucket leave lst->idx near the end. Positions are unchanged in the
+	 * first case, those past the new end wrapping around to the start,
+	 * which the elements there have already left; in the second, they all
+	 * move up by the same amount.
+	 */
+	if (wrapped <= 0) return true;
+
+	if (wrapped <= old_capacity - lst->idx) {
+		for (lst_index_t i = 0; i < wrapped; i++) lst_copy(lst, cached, lst->layout, i + old_capacity, i);
+	} else {
+		for (lst_index_t i = old_capacity - 1; i >= lst->idx; i--) lst_copy(lst, cached, lst->layout, i + delta, i);
+		lst_indices_shift(lst, delta);
+	}
+
+	return true;
+}
+
+/*
+ * Grow a full LST by its growth factor, or as far as it can.
+ */
+static bool lst_grow(lst_t *lst)
+{
+	int64_t	n;
+
+	/*
+	 * A segmented LST's directory stays a power of two, so it grows by
+	 * at least a factor of two whatever the growth factor says.
+	 */
+	if (lst->segment) {
+		n = lst->segments * lst->growth;
+		n = (n < SEGMENTS_MAX) ? pow2_roundup(n) : SEGMENTS_MAX;
+		if (n <= lst->segments) n = (lst->segments < SEGMENTS_MAX) ? lst->segments * 2 : SEGMENTS_MAX;
+		n = (n - 1) * SEGMENT_SIZE;
+	} else {
+		n = lst->capacity * lst->growth;
+		if (n <= lst->capacity) n = (int64_t)lst->capacity + 1;
+		if (n > ARRAY_CAPACITY_MAX) n = ARRAY_CAPACITY_MAX;
+	}
+	if (n <= lst->capacity) return false;
+
+	return lst_expand(lst, n);
+}
+
+/*
+ * Shrink a flat LST's array to n_capacity, no less than the number of
+ * elements. If they wrap around the end of the array, those from lst->idx
+ * on move down to the new end; otherwise, if they run past the new end,
+ * they all move down to the start. Either way, every position moves down
+ * by the same amount.
+ */
+static void array_shrink(lst_t *lst, lst_index_t n_capacity)
+{
+	lst_index_t	shift = 0, from, end = 0;
+	bool		cached = lst->key_project != NULL;
+	void		**n;
+
+	lst_indices_reduce(lst);
+	from = lst->idx;
+	if (lst->idx + lst->num_elements > lst->capacity) {
+		shift = lst->capacity - n_capacity;
+		end = lst->capacity;
+	} else if (lst->idx + lst->num_elements > n_capacity) {
+		shift = lst->idx;
+		end = lst->idx + lst->num_elements;
+	}
+
+	for (; from < end; from++) {
+		lst_index_t	to = from - shift;
+
+		lst->p[to] = lst->p[from];
+		if (cached) lst->keys[to] = lst->keys[from];
+		if (is_indexed(lst->layout)) item_index(lst, lst->p[to]) = to;
+	}
+	lst_indices_shift(lst, -shift);
+	lst->capacity = n_capacity;
+	modulus_set(lst, n_capacity);
+
+	/*
+	 * Should realloc() fail, the larger arrays are still good.
+	 */
+	n = realloc(lst->p, sizeof(void *) * n_capacity);
+	if (n) lst->p = n;
+	if (cached) {
+		uint64_t	*n_keys = realloc(lst->keys, sizeof(uint64_t) * n_capacity);
+
+		if (n_keys) lst->keys = n_keys;
+	}
+}
+
+/*
+ * Shrink a segmented LST: free the segments holding no elements, and if
+ * n_segments is fewer than it has, halve its directories until they have
+ * that many slots. As in segments_expand(), the segments in use keep their
+ * positions and just move to new slots.
+ */
+static void segments_shrink(lst_t *lst, lst_index_t n_segments)
+{
+	lst_index_t	first = index_reduce(lst, LAYOUT_SEGMENTED, lst->idx) >> SEGMENT_SHIFT;
+	lst_index_t	used = 0;
+	void		***n_segment;
+	uint64_t	**n_key_segment = NULL;
+
+	if (lst->num_elements > 0) {
+		lst_index_t	last = index_reduce(lst, LAYOUT_SEGMENTED, lst->idx + lst->num_elements - 1) >> SEGMENT_SHIFT;
+
+		used = ((last - first) & (POSITION_MASK >> SEGMENT_SHIFT)) + 1;
+	}
+
+	for (lst_index_t i = used; i < lst->segments; i++) {
+		lst_index_t	slot = (first + i) & (lst->segments - 1);
+
+		free(lst->segment[slot]);
+		lst->segment[slot] = NULL;
+		if (lst->key_segment) {
+			free(lst->key_segment[slot]);
+			lst->key_segment[slot] = NULL;
+		}
+	}
+
+	if (n_segments >= lst->segments) return;
+
+	n_segment = calloc(n_segments, sizeof(void **));
+	if (!n_segment) return;
+	if (lst->key_segment) {
+		n_key_segment = calloc(n_segments, sizeof(uint64_t *));
+		if (!n_key_segment) {
+			free(n_segment);
+			return;
+		}
+	}
+
+	for (lst_index_t i = 0; i < used; i++) {
+		lst_index_t	slot = (first + i) & (lst->segments - 1), n_slot = (first + i) & (n_segments - 1);
+
+		n_segment[n_slot] = lst->segment[slot];
+		if (n_key_segment) n_key_segment[n_slot] = lst->key_segment[slot];
+	}
+
+	free(lst->segment);
+	free(lst->key_segment);
+	lst->segment = n_segment;
+	lst->key_segment = n_key_segment;
+	lst->segments = n_segments;
+	lst->capacity = (n_segments - 1) * SEGMENT_SIZE;
+}
+
+/*
+ * Shrink an LST to the least capacity, no less than it started with, that
+ * holds n elements. A multi-way partition's scratch arrays can be as big
+ * as the largest bucket it has split, so if they outgrow the new capacity
+ * they go too, to be reallocated when next needed.
+ */
+static void lst_shrink(lst_t *lst, lst_index_t n)
+{
+	if (n < lst->min_capacity) n = lst->min_capacity;
+
+	if (lst->segment) {
+		segments_shrink(lst, directory_size(n));
+	} else if (n < lst->capacity) {
+		array_shrink(lst, n);
+	}
+
+	if (lst->scratch_size > lst->capacity) {
+		free(lst->scratch);
+		free(lst->oracle);
+		lst->scratch = NULL;
+		lst->oracle = NULL;
+		lst->scratch_size = 0;
+	}
+	shrink_threshold_set(lst);
+}
+
+/*
+ * Return the index of the median of three elements.
+ */
+static inline __attribute__((always_inline, nonnull)) lst_index_t median_of_3(lst_t *lst, lst_index_t a,
+									     lst_index_t b, lst_index_t c)
+{
+	layout_t	layout = lst->layout;
+	void		*pa = item(lst, layout, a), *pb = item(lst, layout, b), *pc = item(lst, layout, c);
+
+	if (lst->cmp(pa, pb) < 0) {
+		if (lst->cmp(pb, pc) < 0) return b;
+		return (lst->cmp(pa, pc) < 0) ? c : a;
+	}
+	if (lst->cmp(pa, pc) < 0) return a;
+	return (lst->cmp(pb, pc) < 0) ? c : b;
+}
+
+/*
+ * Pick the element at the configured percentile of a random sample.
+ * The sample is small, so an insertion sort of the pointers is fine.
+ */
+static lst_index_t quantile_pivot(lst_t *lst, lst_index_t low, lst_index_t n)
+{
+	lst_index_t	sample[PIVOT_SAMPLE_MAX];
+	int		k = (n / 16 < PIVOT_SAMPLE_MAX) ? n / 16 : PIVOT_SAMPLE_MAX;
+	layout_t	layout = lst->layout;
+
+	if (k < 3) k = 3;
+	for (int i = 0; i < k; i++) {
+		lst_index_t	candidate = low + lst_rand_range(lst, n);
+		int		j;
+
+		for (j = i; j > 0 && lst->cmp(item(lst, layout, candidate), item(lst, layout, sample[j - 1])) < 0; j--) {
+			sample[j] = sample[j - 1];
+		}
+		sample[j] = candidate;
+	}
+
+	return sample[(k * lst->pivot_quantile) / 100];
+}
+
+/*
+ * Choose a pivot for the bucket [low, high] according to the LST's policy.
+ */
+static lst_index_t pivot_select(lst_t *lst, lst_index_t low, lst_index_t high)
+{
+	lst_index_t	n = high + 1 - low;
+
+	if (lst->pivot_policy == LST_PIVOT_RANDOM || n < PIVOT_SAMPLE_MIN) return low + lst_rand_range(lst, n);
+
+#define RANDOM_INDEX	(low + lst_rand_range(lst, n))
+	switch (lst->pivot_policy) {
+	case LST_PIVOT_MEDIAN_OF_3:
+		return median_of_3(lst, RANDOM_INDEX, RANDOM_INDEX, RANDOM_INDEX);
+
+	case LST_PIVOT_NINTHER:
+		return median_of_3(lst,
+				   median_of_3(lst, RANDOM_INDEX, RANDOM_INDEX, RANDOM_INDEX),
+				   median_of_3(lst, RANDOM_INDEX, RANDOM_INDEX, RANDOM_INDEX),
+				   median_of_3(lst, RANDOM_INDEX, RANDOM_INDEX, RANDOM_INDEX));
+
+	case LST_PIVOT_QUANTILE:
+		return quantile_pivot(lst, low, n);
+
+	default:
+		return RANDOM_INDEX;
+	}
+#undef RANDOM_INDEX
+}
+
+/*
+ * Hoare partition of [low, high] around the pivot, which the caller has
+ * placed at low, returning where the pivot ends up. On the average, it
+ * does a third the swaps of Lomuto. Like cached and layout, prefetch is a
+ * constant, so the scans stay as tight as they were when it's false.
+ */
+static inline __attribute__((always_inline, nonnull)) lst_index_t hoare_split(lst_t *lst, lst_index_t low, lst_index_t high,
+									     void *pivot, bool cached, bool prefetch,
+									     layout_t layout)
+{
+	lst_index_t	l, h;
+	lst_index_t	pivot_index = low;
+	uint64_t	pivot_key = location_key(lst, cached, layout, low);
+
+	/*
+	 * Hoare partition doesn't guarantee the pivot sits at location h
+	 * the way Lomuto does and LST needs, so we follow it. The first scan
+	 * from the left stops at the pivot, and if that's swapped, the scans
+	 * don't reach where it goes.
+	 */
+	l = low - 1;
+	h = high + 1;
+	for (;;) {
+		do prefetch_compare(lst, prefetch, layout, --h - PREFETCH_DISTANCE, low, high);
+		while (item_cmp(lst, cached, layout, h, pivot, pivot_key) > 0);
+		do prefetch_compare(lst, prefetch, layout, ++l + PREFETCH_DISTANCE, low, high);
+		while (item_cmp(lst, cached, layout, l, pivot, pivot_key) < 0);
+		if (l >= h) break;
+		if (l == pivot_index) pivot_index = h;
+		lst_swap(lst, cached, layout, l, h);
+	}
+
+	/*
+	 * Move it to h if need be.
+	 */
+	if (pivot_index < h) lst_swap(lst, cached, layout, pivot_index, h);
+	if (pivot_index > h) lst_swap(lst, cached, layout, pivot_index, ++h);
+
+	return h;
+}
+
+static inline __attribute__((always_inline, nonnull)) void partition_hoare(lst_t *lst, lst_index_t low, lst_index_t high,
+									  void *pivot, bool cached, bool prefetch,
+									  layout_t layout)
+{
+	lst_index_t	h = hoare_split(lst, low, high, pivot, cached, prefetch, layout);
+
+	stack_push(&lst->s, h, location_key(lst, cached, layout, h));
+}
+
+/*
+ * Not in the paper: introselect-style protection. A random pivot is badly
+ * placed now and then, but pivots an adversary can predict, or that a
+ * policy's sample misjudges, may be badly placed every time, and the
+ * partitions' total work then grows quadratically. So partition() notes
+ * how skewed each split is, and after INTROSELECT_BAD_SPLITS bad ones in
+ * a row splits around the median of medians instead, which is never
+ * closer than 30% to either end, until a split is good again.
+ */
+
+/*
+ * Insertion sort of the n (at most five) elements from low.
+ */
+static void group_sort(lst_t *lst, bool cached, layout_t layout, lst_index_t low, lst_index_t n)
+{
+	for (lst_index_t i = 1; i < n; i++) {
+		for (lst_index_t j = low + i; j > low &&
+		     item_cmp(lst, cached, layout, j - 1, item(lst, layout, j), location_key(lst, cached, layout, j)) > 0; j--) {
+			lst_swap(lst, cached, layout, j - 1, j);
+		}
+	}
+}
+
+/*
+ * Move the element of rank k, counting from 0, in [low, high] to low + k,
+ * with none greater before it and none smaller after, in linear time: the
+ * selection of Blum, Floyd, Pratt, Rivest and Tarjan, partitioning around
+ * the median of the medians of groups of five, which it gathers at low and
+ * selects recursively.
+ */
+static lst_index_t mom_select(lst_t *lst, lst_index_t low, lst_index_t high, lst_index_t k)
+{
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+
+	for (;;) {
+		lst_index_t	n = high + 1 - low, groups = n / 5, pivot_index;
+
+		if (n <= 5) {
+			group_sort(lst, cached, layout, low, n);
+			return low + k;
+		}
+
+		/*
+		 * Group g's median goes to low + g, which is in a group
+		 * already done with.
+		 */
+		for (lst_index_t g = 0; g < groups; g++) {
+			group_sort(lst, cached, layout, low + 5 * g, 5);
+			lst_swap(lst, cached, layout, low + g, low + 5 * g + 2);
+		}
+		pivot_index = mom_select(lst, low, low + groups - 1, groups / 2);
+		if (pivot_index != low) lst_swap(lst, cached, layout, pivot_index, low);
+
+		pivot_index = hoare_split(lst, low, high, item(lst, layout, low), cached, false, layout);
+		if (low + k == pivot_index) return pivot_index;
+		if (low + k < pivot_index) {
+			high = pivot_index - 1;
+		} else {
+			k -= pivot_index + 1 - low;
+			low = pivot_index + 1;
+		}
+	}
+}
+
+/*
+ * Note whether partitioning [low, high], the bucket at stack_index, split
+ * it badly: whether the elements left of the new pivots, or right of them,
+ * are nearly all of them. Splits by a quantile pivot are meant to be
+ * skewed, so nearly all means all but an eighth of what the quantile
+ * would leave on the other side; otherwise, all but a sixteenth, which a
+ * random pivot does one time in eight.
+ */
+static void split_note(lst_t *lst, stack_index_t stack_index, lst_index_t low, lst_index_t high)
+{
+	int64_t		n = high + 1 - low;
+	int64_t		left = stack_item(&lst->s, stack_depth(&lst->s) - 1) - low;
+	int64_t		right = high - stack_item(&lst->s, stack_index + 1);
+	int		q = (lst->pivot_policy == LST_PIVOT_QUANTILE) ? lst->pivot_quantile : 50;
+
+	if (n < INTROSELECT_MIN) return;
+	if (left * 800 > n * (800 - (100 - q)) || right * 800 > n * (800 - q)) {
+		if (lst->bad_splits < INTROSELECT_BAD_SPLITS) lst->bad_splits++;
+	} else {
+		lst->bad_splits = 0;
+	}
+}
+
+/*
+ * Offsets, within a byte of a mask, of its set bits: ascending, and as
+ * 8 - offset in descending order, for the left and right blocks of a
+ * block partition respectively. Unused entries are zero.
+ */
+static uint8_t const mask_offsets_asc[256][8] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 0, 0, 0, 0, 0, 0 },
+	{ 2, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 0, 0, 0, 0, 0, 0 },
+	{ 1, 2, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 0, 0, 0, 0, 0 },
+	{ 3, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 0, 0, 0, 0, 0, 0 },
+	{ 1, 3, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 3, 0, 0, 0, 0, 0 },
+	{ 2, 3, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 3, 0, 0, 0, 0, 0 },
+	{ 1, 2, 3, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 0, 0, 0, 0 },
+	{ 4, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 4, 0, 0, 0, 0, 0, 0 },
+	{ 1, 4, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 4, 0, 0, 0, 0, 0 },
+	{ 2, 4, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 4, 0, 0, 0, 0, 0 },
+	{ 1, 2, 4, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 4, 0, 0, 0, 0 },
+	{ 3, 4, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 4, 0, 0, 0, 0, 0 },
+	{ 1, 3, 4, 0, 0, 0, 0, 0 },
+	{ 0, 1, 3, 4, 0, 0, 0, 0 },
+	{ 2, 3, 4, 0, 0, 0, 0, 0 },
+	{ 0, 2, 3, 4, 0, 0, 0, 0 },
+	{ 1, 2, 3, 4, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 4, 0, 0, 0 },
+	{ 5, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 5, 0, 0, 0, 0, 0, 0 },
+	{ 1, 5, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 5, 0, 0, 0, 0, 0 },
+	{ 2, 5, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 5, 0, 0, 0, 0, 0 },
+	{ 1, 2, 5, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 5, 0, 0, 0, 0 },
+	{ 3, 5, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 5, 0, 0, 0, 0, 0 },
+	{ 1, 3, 5, 0, 0, 0, 0, 0 },
+	{ 0, 1, 3, 5, 0, 0, 0, 0 },
+	{ 2, 3, 5, 0, 0, 0, 0, 0 },
+	{ 0, 2, 3, 5, 0, 0, 0, 0 },
+	{ 1, 2, 3, 5, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 5, 0, 0, 0 },
+	{ 4, 5, 0, 0, 0, 0, 0, 0 },
+	{ 0, 4, 5, 0, 0, 0, 0, 0 },
+	{ 1, 4, 5, 0, 0, 0, 0, 0 },
+	{ 0, 1, 4, 5, 0, 0, 0, 0 },
+	{ 2, 4, 5, 0, 0, 0, 0, 0 },
+	{ 0, 2, 4, 5, 0, 0, 0, 0 },
+	{ 1, 2, 4, 5, 0, 0, 0, 0 },
+	{ 0, 1, 2, 4, 5, 0, 0, 0 },
+	{ 3, 4, 5, 0, 0, 0, 0, 0 },
+	{ 0, 3, 4, 5, 0, 0, 0, 0 },
+	{ 1, 3, 4, 5, 0, 0, 0, 0 },
+	{ 0, 1, 3, 4, 5, 0, 0, 0 },
+	{ 2, 3, 4, 5, 0, 0, 0, 0 },
+	{ 0, 2, 3, 4, 5, 0, 0, 0 },
+	{ 1, 2, 3, 4, 5, 0, 0, 0 },
+	{ 0, 1, 2, 3, 4, 5, 0, 0 },
+	{ 6, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 6, 0, 0, 0, 0, 0, 0 },
+	{ 1, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 6, 0, 0, 0, 0, 0 },
+	{ 2, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 6, 0, 0, 0, 0, 0 },
+	{ 1, 2, 6, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 6, 0, 0, 0, 0 },
+	{ 3, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 6, 0, 0, 0, 0, 0 },
+	{ 1, 3, 6, 0, 0, 0, 0, 0 },
+	{ 0, 1, 3, 6, 0, 0, 0, 0 },
+	{ 2, 3, 6, 0, 0, 0, 0, 0 },
+	{ 0, 2, 3, 6, 0, 0, 0, 0 },
+	{ 1, 2, 3, 6, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 6, 0, 0, 0 },
+	{ 4, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 4, 6, 0, 0, 0, 0, 0 },
+	{ 1, 4, 6, 0, 0, 0, 0, 0 },
+	{ 0, 1, 4, 6, 0, 0, 0, 0 },
+	{ 2, 4, 6, 0, 0, 0, 0, 0 },
+	{ 0, 2, 4, 6, 0, 0, 0, 0 },
+	{ 1, 2, 4, 6, 0, 0, 0, 0 },
+	{ 0, 1, 2, 4, 6, 0, 0, 0 },
+	{ 3, 4, 6, 0, 0, 0, 0, 0 },
+	{ 0, 3, 4, 6, 0, 0, 0, 0 },
+	{ 1, 3, 4, 6, 0, 0, 0, 0 },
+	{ 0, 1, 3, 4, 6, 0, 0, 0 },
+	{ 2, 3, 4, 6, 0, 0, 0, 0 },
+	{ 0, 2, 3, 4, 6, 0, 0, 0 },
+	{ 1, 2, 3, 4, 6, 0, 0, 0 },
+	{ 0, 1, 2, 3, 4, 6, 0, 0 },
+	{ 5, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 5, 6, 0, 0, 0, 0, 0 },
+	{ 1, 5, 6, 0, 0, 0, 0, 0 },
+	{ 0, 1, 5, 6, 0, 0, 0, 0 },
+	{ 2, 5, 6, 0, 0, 0, 0, 0 },
+	{ 0, 2, 5, 6, 0, 0, 0, 0 },
+	{ 1, 2, 5, 6, 0, 0, 0, 0 },
+	{ 0, 1, 2, 5, 6, 0, 0, 0 },
+	{ 3, 5, 6, 0, 0, 0, 0, 0 },
+	{ 0, 3, 5, 6, 0, 0, 0, 0 },
+	{ 1, 3, 5, 6, 0, 0, 0, 0 },
+	{ 0, 1, 3, 5, 6, 0, 0, 0 },
+	{ 2, 3, 5, 6, 0, 0, 0, 0 },
+	{ 0, 2, 3, 5, 6, 0, 0, 0 },
+	{ 1, 2, 3, 5, 6, 0, 0, 0 },
+	{ 0, 1, 2, 3, 5, 6, 0, 0 },
+	{ 4, 5, 6, 0, 0, 0, 0, 0 },
+	{ 0, 4, 5, 6, 0, 0, 0, 0 },
+	{ 1, 4, 5, 6, 0, 0, 0, 0 },
+	{ 0, 1, 4, 5, 6, 0, 0, 0 },
+	{ 2, 4, 5, 6, 0, 0, 0, 0 },
+	{ 0, 2, 4, 5, 6, 0, 0, 0 },
+	{ 1, 2, 4, 5, 6, 0, 0, 0 },
+	{ 0, 1, 2, 4, 5, 6, 0, 0 },
+	{ 3, 4, 5, 6, 0, 0, 0, 0 },
+	{ 0, 3, 4, 5, 6, 0, 0, 0 },
+	{ 1, 3, 4, 5, 6, 0, 0, 0 },
+	{ 0, 1, 3, 4, 5, 6, 0, 0 },
+	{ 2, 3, 4, 5, 6, 0, 0, 0 },
+	{ 0, 2, 3, 4, 5, 6, 0, 0 },
+	{ 1, 2, 3, 4, 5, 6, 0, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 0 },
+	{ 7, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 7, 0, 0, 0, 0, 0, 0 },
+	{ 1, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 7, 0, 0, 0, 0, 0 },
+	{ 2, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 2, 7, 0, 0, 0, 0, 0 },
+	{ 1, 2, 7, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 7, 0, 0, 0, 0 },
+	{ 3, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 7, 0, 0, 0, 0, 0 },
+	{ 1, 3, 7, 0, 0, 0, 0, 0 },
+	{ 0, 1, 3, 7, 0, 0, 0, 0 },
+	{ 2, 3, 7, 0, 0, 0, 0, 0 },
+	{ 0, 2, 3, 7, 0, 0, 0, 0 },
+	{ 1, 2, 3, 7, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 7, 0, 0, 0 },
+	{ 4, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 4, 7, 0, 0, 0, 0, 0 },
+	{ 1, 4, 7, 0, 0, 0, 0, 0 },
+	{ 0, 1, 4, 7, 0, 0, 0, 0 },
+	{ 2, 4, 7, 0, 0, 0, 0, 0 },
+	{ 0, 2, 4, 7, 0, 0, 0, 0 },
+	{ 1, 2, 4, 7, 0, 0, 0, 0 },
+	{ 0, 1, 2, 4, 7, 0, 0, 0 },
+	{ 3, 4, 7, 0, 0, 0, 0, 0 },
+	{ 0, 3, 4, 7, 0, 0, 0, 0 },
+	{ 1, 3, 4, 7, 0, 0, 0, 0 },
+	{ 0, 1, 3, 4, 7, 0, 0, 0 },
+	{ 2, 3, 4, 7, 0, 0, 0, 0 },
+	{ 0, 2, 3, 4, 7, 0, 0, 0 },
+	{ 1, 2, 3, 4, 7, 0, 0, 0 },
+	{ 0, 1, 2, 3, 4, 7, 0, 0 },
+	{ 5, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 5, 7, 0, 0, 0, 0, 0 },
+	{ 1, 5, 7, 0, 0, 0, 0, 0 },
+	{ 0, 1, 5, 7, 0, 0, 0, 0 },
+	{ 2, 5, 7, 0, 0, 0, 0, 0 },
+	{ 0, 2, 5, 7, 0, 0, 0, 0 },
+	{ 1, 2, 5, 7, 0, 0, 0, 0 },
+	{ 0, 1, 2, 5, 7, 0, 0, 0 },
+	{ 3, 5, 7, 0, 0, 0, 0, 0 },
+	{ 0, 3, 5, 7, 0, 0, 0, 0 },
+	{ 1, 3, 5, 7, 0, 0, 0, 0 },
+	{ 0, 1, 3, 5, 7, 0, 0, 0 },
+	{ 2, 3, 5, 7, 0, 0, 0, 0 },
+	{ 0, 2, 3, 5, 7, 0, 0, 0 },
+	{ 1, 2, 3, 5, 7, 0, 0, 0 },
+	{ 0, 1, 2, 3, 5, 7, 0, 0 },
+	{ 4, 5, 7, 0, 0, 0, 0, 0 },
+	{ 0, 4, 5, 7, 0, 0, 0, 0 },
+	{ 1, 4, 5, 7, 0, 0, 0, 0 },
+	{ 0, 1, 4, 5, 7, 0, 0, 0 },
+	{ 2, 4, 5, 7, 0, 0, 0, 0 },
+	{ 0, 2, 4, 5, 7, 0, 0, 0 },
+	{ 1, 2, 4, 5, 7, 0, 0, 0 },
+	{ 0, 1, 2, 4, 5, 7, 0, 0 },
+	{ 3, 4, 5, 7, 0, 0, 0, 0 },
+	{ 0, 3, 4, 5, 7, 0, 0, 0 },
+	{ 1, 3, 4, 5, 7, 0, 0, 0 },
+	{ 0, 1, 3, 4, 5, 7, 0, 0 },
+	{ 2, 3, 4, 5, 7, 0, 0, 0 },
+	{ 0, 2, 3, 4, 5, 7, 0, 0 },
+	{ 1, 2, 3, 4, 5, 7, 0, 0 },
+	{ 0, 1, 2, 3, 4, 5, 7, 0 },
+	{ 6, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 6, 7, 0, 0, 0, 0, 0 },
+	{ 1, 6, 7, 0, 0, 0, 0, 0 },
+	{ 0, 1, 6, 7, 0, 0, 0, 0 },
+	{ 2, 6, 7, 0, 0, 0, 0, 0 },
+	{ 0, 2, 6, 7, 0, 0, 0, 0 },
+	{ 1, 2, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 2, 6, 7, 0, 0, 0 },
+	{ 3, 6, 7, 0, 0, 0, 0, 0 },
+	{ 0, 3, 6, 7, 0, 0, 0, 0 },
+	{ 1, 3, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 3, 6, 7, 0, 0, 0 },
+	{ 2, 3, 6, 7, 0, 0, 0, 0 },
+	{ 0, 2, 3, 6, 7, 0, 0, 0 },
+	{ 1, 2, 3, 6, 7, 0, 0, 0 },
+	{ 0, 1, 2, 3, 6, 7, 0, 0 },
+	{ 4, 6, 7, 0, 0, 0, 0, 0 },
+	{ 0, 4, 6, 7, 0, 0, 0, 0 },
+	{ 1, 4, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 4, 6, 7, 0, 0, 0 },
+	{ 2, 4, 6, 7, 0, 0, 0, 0 },
+	{ 0, 2, 4, 6, 7, 0, 0, 0 },
+	{ 1, 2, 4, 6, 7, 0, 0, 0 },
+	{ 0, 1, 2, 4, 6, 7, 0, 0 },
+	{ 3, 4, 6, 7, 0, 0, 0, 0 },
+	{ 0, 3, 4, 6, 7, 0, 0, 0 },
+	{ 1, 3, 4, 6, 7, 0, 0, 0 },
+	{ 0, 1, 3, 4, 6, 7, 0, 0 },
+	{ 2, 3, 4, 6, 7, 0, 0, 0 },
+	{ 0, 2, 3, 4, 6, 7, 0, 0 },
+	{ 1, 2, 3, 4, 6, 7, 0, 0 },
+	{ 0, 1, 2, 3, 4, 6, 7, 0 },
+	{ 5, 6, 7, 0, 0, 0, 0, 0 },
+	{ 0, 5, 6, 7, 0, 0, 0, 0 },
+	{ 1, 5, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 5, 6, 7, 0, 0, 0 },
+	{ 2, 5, 6, 7, 0, 0, 0, 0 },
+	{ 0, 2, 5, 6, 7, 0, 0, 0 },
+	{ 1, 2, 5, 6, 7, 0, 0, 0 },
+	{ 0, 1, 2, 5, 6, 7, 0, 0 },
+	{ 3, 5, 6, 7, 0, 0, 0, 0 },
+	{ 0, 3, 5, 6, 7, 0, 0, 0 },
+	{ 1, 3, 5, 6, 7, 0, 0, 0 },
+	{ 0, 1, 3, 5, 6, 7, 0, 0 },
+	{ 2, 3, 5, 6, 7, 0, 0, 0 },
+	{ 0, 2, 3, 5, 6, 7, 0, 0 },
+	{ 1, 2, 3, 5, 6, 7, 0, 0 },
+	{ 0, 1, 2, 3, 5, 6, 7, 0 },
+	{ 4, 5, 6, 7, 0, 0, 0, 0 },
+	{ 0, 4, 5, 6, 7, 0, 0, 0 },
+	{ 1, 4, 5, 6, 7, 0, 0, 0 },
+	{ 0, 1, 4, 5, 6, 7, 0, 0 },
+	{ 2, 4, 5, 6, 7, 0, 0, 0 },
+	{ 0, 2, 4, 5, 6, 7, 0, 0 },
+	{ 1, 2, 4, 5, 6, 7, 0, 0 },
+	{ 0, 1, 2, 4, 5, 6, 7, 0 },
+	{ 3, 4, 5, 6, 7, 0, 0, 0 },
+	{ 0, 3, 4, 5, 6, 7, 0, 0 },
+	{ 1, 3, 4, 5, 6, 7, 0, 0 },
+	{ 0, 1, 3, 4, 5, 6, 7, 0 },
+	{ 2, 3, 4, 5, 6, 7, 0, 0 },
+	{ 0, 2, 3, 4, 5, 6, 7, 0 },
+	{ 1, 2, 3, 4, 5, 6, 7, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7 },
+};
+
+static uint8_t const mask_offsets_desc[256][8] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 8, 0, 0, 0, 0, 0, 0, 0 },
+	{ 7, 0, 0, 0, 0, 0, 0, 0 },
+	{ 7, 8, 0, 0, 0, 0, 0, 0 },
+	{ 6, 0, 0, 0, 0, 0, 0, 0 },
+	{ 6, 8, 0, 0, 0, 0, 0, 0 },
+	{ 6, 7, 0, 0, 0, 0, 0, 0 },
+	{ 6, 7, 8, 0, 0, 0, 0, 0 },
+	{ 5, 0, 0, 0, 0, 0, 0, 0 },
+	{ 5, 8, 0, 0, 0, 0, 0, 0 },
+	{ 5, 7, 0, 0, 0, 0, 0, 0 },
+	{ 5, 7, 8, 0, 0, 0, 0, 0 },
+	{ 5, 6, 0, 0, 0, 0, 0, 0 },
+	{ 5, 6, 8, 0, 0, 0, 0, 0 },
+	{ 5, 6, 7, 0, 0, 0, 0, 0 },
+	{ 5, 6, 7, 8, 0, 0, 0, 0 },
+	{ 4, 0, 0, 0, 0, 0, 0, 0 },
+	{ 4, 8, 0, 0, 0, 0, 0, 0 },
+	{ 4, 7, 0, 0, 0, 0, 0, 0 },
+	{ 4, 7, 8, 0, 0, 0, 0, 0 },
+	{ 4, 6, 0, 0, 0, 0, 0, 0 },
+	{ 4, 6, 8, 0, 0, 0, 0, 0 },
+	{ 4, 6, 7, 0, 0, 0, 0, 0 },
+	{ 4, 6, 7, 8, 0, 0, 0, 0 },
+	{ 4, 5, 0, 0, 0, 0, 0, 0 },
+	{ 4, 5, 8, 0, 0, 0, 0, 0 },
+	{ 4, 5, 7, 0, 0, 0, 0, 0 },
+	{ 4, 5, 7, 8, 0, 0, 0, 0 },
+	{ 4, 5, 6, 0, 0, 0, 0, 0 },
+	{ 4, 5, 6, 8, 0, 0, 0, 0 },
+	{ 4, 5, 6, 7, 0, 0, 0, 0 },
+	{ 4, 5, 6, 7, 8, 0, 0, 0 },
+	{ 3, 0, 0, 0, 0, 0, 0, 0 },
+	{ 3, 8, 0, 0, 0, 0, 0, 0 },
+	{ 3, 7, 0, 0, 0, 0, 0, 0 },
+	{ 3, 7, 8, 0, 0, 0, 0, 0 },
+	{ 3, 6, 0, 0, 0, 0, 0, 0 },
+	{ 3, 6, 8, 0, 0, 0, 0, 0 },
+	{ 3, 6, 7, 0, 0, 0, 0, 0 },
+	{ 3, 6, 7, 8, 0, 0, 0, 0 },
+	{ 3, 5, 0, 0, 0, 0, 0, 0 },
+	{ 3, 5, 8, 0, 0, 0, 0, 0 },
+	{ 3, 5, 7, 0, 0, 0, 0, 0 },
+	{ 3, 5, 7, 8, 0, 0, 0, 0 },
+	{ 3, 5, 6, 0, 0, 0, 0, 0 },
+	{ 3, 5, 6, 8, 0, 0, 0, 0 },
+	{ 3, 5, 6, 7, 0, 0, 0, 0 },
+	{ 3, 5, 6, 7, 8, 0, 0, 0 },
+	{ 3, 4, 0, 0, 0, 0, 0, 0 },
+	{ 3, 4, 8, 0, 0, 0, 0, 0 },
+	{ 3, 4, 7, 0, 0, 0, 0, 0 },
+	{ 3, 4, 7, 8, 0, 0, 0, 0 },
+	{ 3, 4, 6, 0, 0, 0, 0, 0 },
+	{ 3, 4, 6, 8, 0, 0, 0, 0 },
+	{ 3, 4, 6, 7, 0, 0, 0, 0 },
+	{ 3, 4, 6, 7, 8, 0, 0, 0 },
+	{ 3, 4, 5, 0, 0, 0, 0, 0 },
+	{ 3, 4, 5, 8, 0, 0, 0, 0 },
+	{ 3, 4, 5, 7, 0, 0, 0, 0 },
+	{ 3, 4, 5, 7, 8, 0, 0, 0 },
+	{ 3, 4, 5, 6, 0, 0, 0, 0 },
+	{ 3, 4, 5, 6, 8, 0, 0, 0 },
+	{ 3, 4, 5, 6, 7, 0, 0, 0 },
+	{ 3, 4, 5, 6, 7, 8, 0, 0 },
+	{ 2, 0, 0, 0, 0, 0, 0, 0 },
+	{ 2, 8, 0, 0, 0, 0, 0, 0 },
+	{ 2, 7, 0, 0, 0, 0, 0, 0 },
+	{ 2, 7, 8, 0, 0, 0, 0, 0 },
+	{ 2, 6, 0, 0, 0, 0, 0, 0 },
+	{ 2, 6, 8, 0, 0, 0, 0, 0 },
+	{ 2, 6, 7, 0, 0, 0, 0, 0 },
+	{ 2, 6, 7, 8, 0, 0, 0, 0 },
+	{ 2, 5, 0, 0, 0, 0, 0, 0 },
+	{ 2, 5, 8, 0, 0, 0, 0, 0 },
+	{ 2, 5, 7, 0, 0, 0, 0, 0 },
+	{ 2, 5, 7, 8, 0, 0, 0, 0 },
+	{ 2, 5, 6, 0, 0, 0, 0, 0 },
+	{ 2, 5, 6, 8, 0, 0, 0, 0 },
+	{ 2, 5, 6, 7, 0, 0, 0, 0 },
+	{ 2, 5, 6, 7, 8, 0, 0, 0 },
+	{ 2, 4, 0, 0, 0, 0, 0, 0 },
+	{ 2, 4, 8, 0, 0, 0, 0, 0 },
+	{ 2, 4, 7, 0, 0, 0, 0, 0 },
+	{ 2, 4, 7, 8, 0, 0, 0, 0 },
+	{ 2, 4, 6, 0, 0, 0, 0, 0 },
+	{ 2, 4, 6, 8, 0, 0, 0, 0 },
+	{ 2, 4, 6, 7, 0, 0, 0, 0 },
+	{ 2, 4, 6, 7, 8, 0, 0, 0 },
+	{ 2, 4, 5, 0, 0, 0, 0, 0 },
+	{ 2, 4, 5, 8, 0, 0, 0, 0 },
+	{ 2, 4, 5, 7, 0, 0, 0, 0 },
+	{ 2, 4, 5, 7, 8, 0, 0, 0 },
+	{ 2, 4, 5, 6, 0, 0, 0, 0 },
+	{ 2, 4, 5, 6, 8, 0, 0, 0 },
+	{ 2, 4, 5, 6, 7, 0, 0, 0 },
+	{ 2, 4, 5, 6, 7, 8, 0, 0 },
+	{ 2, 3, 0, 0, 0, 0, 0, 0 },
+	{ 2, 3, 8, 0, 0, 0, 0, 0 },
+	{ 2, 3, 7, 0, 0, 0, 0, 0 },
+	{ 2, 3, 7, 8, 0, 0, 0, 0 },
+	{ 2, 3, 6, 0, 0, 0, 0, 0 },
+	{ 2, 3, 6, 8, 0, 0, 0, 0 },
+	{ 2, 3, 6, 7, 0, 0, 0, 0 },
+	{ 2, 3, 6, 7, 8, 0, 0, 0 },
+	{ 2, 3, 5, 0, 0, 0, 0, 0 },
+	{ 2, 3, 5, 8, 0, 0, 0, 0 },
+	{ 2, 3, 5, 7, 0, 0, 0, 0 },
+	{ 2, 3, 5, 7, 8, 0, 0, 0 },
+	{ 2, 3, 5, 6, 0, 0, 0, 0 },
+	{ 2, 3, 5, 6, 8, 0, 0, 0 },
+	{ 2, 3, 5, 6, 7, 0, 0, 0 },
+	{ 2, 3, 5, 6, 7, 8, 0, 0 },
+	{ 2, 3, 4, 0, 0, 0, 0, 0 },
+	{ 2, 3, 4, 8, 0, 0, 0, 0 },
+	{ 2, 3, 4, 7, 0, 0, 0, 0 },
+	{ 2, 3, 4, 7, 8, 0, 0, 0 },
+	{ 2, 3, 4, 6, 0, 0, 0, 0 },
+	{ 2, 3, 4, 6, 8, 0, 0, 0 },
+	{ 2, 3, 4, 6, 7, 0, 0, 0 },
+	{ 2, 3, 4, 6, 7, 8, 0, 0 },
+	{ 2, 3, 4, 5, 0, 0, 0, 0 },
+	{ 2, 3, 4, 5, 8, 0, 0, 0 },
+	{ 2, 3, 4, 5, 7, 0, 0, 0 },
+	{ 2, 3, 4, 5, 7, 8, 0, 0 },
+	{ 2, 3, 4, 5, 6, 0, 0, 0 },
+	{ 2, 3, 4, 5, 6, 8, 0, 0 },
+	{ 2, 3, 4, 5, 6, 7, 0, 0 },
+	{ 2, 3, 4, 5, 6, 7, 8, 0 },
+	{ 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 1, 8, 0, 0, 0, 0, 0, 0 },
+	{ 1, 7, 0, 0, 0, 0, 0, 0 },
+	{ 1, 7, 8, 0, 0, 0, 0, 0 },
+	{ 1, 6, 0, 0, 0, 0, 0, 0 },
+	{ 1, 6, 8, 0, 0, 0, 0, 0 },
+	{ 1, 6, 7, 0, 0, 0, 0, 0 },
+	{ 1, 6, 7, 8, 0, 0, 0, 0 },
+	{ 1, 5, 0, 0, 0, 0, 0, 0 },
+	{ 1, 5, 8, 0, 0, 0, 0, 0 },
+	{ 1, 5, 7, 0, 0, 0, 0, 0 },
+	{ 1, 5, 7, 8, 0, 0, 0, 0 },
+	{ 1, 5, 6, 0, 0, 0, 0, 0 },
+	{ 1, 5, 6, 8, 0, 0, 0, 0 },
+	{ 1, 5, 6, 7, 0, 0, 0, 0 },
+	{ 1, 5, 6, 7, 8, 0, 0, 0 },
+	{ 1, 4, 0, 0, 0, 0, 0, 0 },
+	{ 1, 4, 8, 0, 0, 0, 0, 0 },
+	{ 1, 4, 7, 0, 0, 0, 0, 0 },
+	{ 1, 4, 7, 8, 0, 0, 0, 0 },
+	{ 1, 4, 6, 0, 0, 0, 0, 0 },
+	{ 1, 4, 6, 8, 0, 0, 0, 0 },
+	{ 1, 4, 6, 7, 0, 0, 0, 0 },
+	{ 1, 4, 6, 7, 8, 0, 0, 0 },
+	{ 1, 4, 5, 0, 0, 0, 0, 0 },
+	{ 1, 4, 5, 8, 0, 0, 0, 0 },
+	{ 1, 4, 5, 7, 0, 0, 0, 0 },
+	{ 1, 4, 5, 7, 8, 0, 0, 0 },
+	{ 1, 4, 5, 6, 0, 0, 0, 0 },
+	{ 1, 4, 5, 6, 8, 0, 0, 0 },
+	{ 1, 4, 5, 6, 7, 0, 0, 0 },
+	{ 1, 4, 5, 6, 7, 8, 0, 0 },
+	{ 1, 3, 0, 0, 0, 0, 0, 0 },
+	{ 1, 3, 8, 0, 0, 0, 0, 0 },
+	{ 1, 3, 7, 0, 0, 0, 0, 0 },
+	{ 1, 3, 7, 8, 0, 0, 0, 0 },
+	{ 1, 3, 6, 0, 0, 0, 0, 0 },
+	{ 1, 3, 6, 8, 0, 0, 0, 0 },
+	{ 1, 3, 6, 7, 0, 0, 0, 0 },
+	{ 1, 3, 6, 7, 8, 0, 0, 0 },
+	{ 1, 3, 5, 0, 0, 0, 0, 0 },
+	{ 1, 3, 5, 8, 0, 0, 0, 0 },
+	{ 1, 3, 5, 7, 0, 0, 0, 0 },
+	{ 1, 3, 5, 7, 8, 0, 0, 0 },
+	{ 1, 3, 5, 6, 0, 0, 0, 0 },
+	{ 1, 3, 5, 6, 8, 0, 0, 0 },
+	{ 1, 3, 5, 6, 7, 0, 0, 0 },
+	{ 1, 3, 5, 6, 7, 8, 0, 0 },
+	{ 1, 3, 4, 0, 0, 0, 0, 0 },
+	{ 1, 3, 4, 8, 0, 0, 0, 0 },
+	{ 1, 3, 4, 7, 0, 0, 0, 0 },
+	{ 1, 3, 4, 7, 8, 0, 0, 0 },
+	{ 1, 3, 4, 6, 0, 0, 0, 0 },
+	{ 1, 3, 4, 6, 8, 0, 0, 0 },
+	{ 1, 3, 4, 6, 7, 0, 0, 0 },
+	{ 1, 3, 4, 6, 7, 8, 0, 0 },
+	{ 1, 3, 4, 5, 0, 0, 0, 0 },
+	{ 1, 3, 4, 5, 8, 0, 0, 0 },
+	{ 1, 3, 4, 5, 7, 0, 0, 0 },
+	{ 1, 3, 4, 5, 7, 8, 0, 0 },
+	{ 1, 3, 4, 5, 6, 0, 0, 0 },
+	{ 1, 3, 4, 5, 6, 8, 0, 0 },
+	{ 1, 3, 4, 5, 6, 7, 0, 0 },
+	{ 1, 3, 4, 5, 6, 7, 8, 0 },
+	{ 1, 2, 0, 0, 0, 0, 0, 0 },
+	{ 1, 2, 8, 0, 0, 0, 0, 0 },
+	{ 1, 2, 7, 0, 0, 0, 0, 0 },
+	{ 1, 2, 7, 8, 0, 0, 0, 0 },
+	{ 1, 2, 6, 0, 0, 0, 0, 0 },
+	{ 1, 2, 6, 8, 0, 0, 0, 0 },
+	{ 1, 2, 6, 7, 0, 0, 0, 0 },
+	{ 1, 2, 6, 7, 8, 0, 0, 0 },
+	{ 1, 2, 5, 0, 0, 0, 0, 0 },
+	{ 1, 2, 5, 8, 0, 0, 0, 0 },
+	{ 1, 2, 5, 7, 0, 0, 0, 0 },
+	{ 1, 2, 5, 7, 8, 0, 0, 0 },
+	{ 1, 2, 5, 6, 0, 0, 0, 0 },
+	{ 1, 2, 5, 6, 8, 0, 0, 0 },
+	{ 1, 2, 5, 6, 7, 0, 0, 0 },
+	{ 1, 2, 5, 6, 7, 8, 0, 0 },
+	{ 1, 2, 4, 0, 0, 0, 0, 0 },
+	{ 1, 2, 4, 8, 0, 0, 0, 0 },
+	{ 1, 2, 4, 7, 0, 0, 0, 0 },
+	{ 1, 2, 4, 7, 8, 0, 0, 0 },
+	{ 1, 2, 4, 6, 0, 0, 0, 0 },
+	{ 1, 2, 4, 6, 8, 0, 0, 0 },
+	{ 1, 2, 4, 6, 7, 0, 0, 0 },
+	{ 1, 2, 4, 6, 7, 8, 0, 0 },
+	{ 1, 2, 4, 5, 0, 0, 0, 0 },
+	{ 1, 2, 4, 5, 8, 0, 0, 0 },
+	{ 1, 2, 4, 5, 7, 0, 0, 0 },
+	{ 1, 2, 4, 5, 7, 8, 0, 0 },
+	{ 1, 2, 4, 5, 6, 0, 0, 0 },
+	{ 1, 2, 4, 5, 6, 8, 0, 0 },
+	{ 1, 2, 4, 5, 6, 7, 0, 0 },
+	{ 1, 2, 4, 5, 6, 7, 8, 0 },
+	{ 1, 2, 3, 0, 0, 0, 0, 0 },
+	{ 1, 2, 3, 8, 0, 0, 0, 0 },
+	{ 1, 2, 3, 7, 0, 0, 0, 0 },
+	{ 1, 2, 3, 7, 8, 0, 0, 0 },
+	{ 1, 2, 3, 6, 0, 0, 0, 0 },
+	{ 1, 2, 3, 6, 8, 0, 0, 0 },
+	{ 1, 2, 3, 6, 7, 0, 0, 0 },
+	{ 1, 2, 3, 6, 7, 8, 0, 0 },
+	{ 1, 2, 3, 5, 0, 0, 0, 0 },
+	{ 1, 2, 3, 5, 8, 0, 0, 0 },
+	{ 1, 2, 3, 5, 7, 0, 0, 0 },
+	{ 1, 2, 3, 5, 7, 8, 0, 0 },
+	{ 1, 2, 3, 5, 6, 0, 0, 0 },
+	{ 1, 2, 3, 5, 6, 8, 0, 0 },
+	{ 1, 2, 3, 5, 6, 7, 0, 0 },
+	{ 1, 2, 3, 5, 6, 7, 8, 0 },
+	{ 1, 2, 3, 4, 0, 0, 0, 0 },
+	{ 1, 2, 3, 4, 8, 0, 0, 0 },
+	{ 1, 2, 3, 4, 7, 0, 0, 0 },
+	{ 1, 2, 3, 4, 7, 8, 0, 0 },
+	{ 1, 2, 3, 4, 6, 0, 0, 0 },
+	{ 1, 2, 3, 4, 6, 8, 0, 0 },
+	{ 1, 2, 3, 4, 6, 7, 0, 0 },
+	{ 1, 2, 3, 4, 6, 7, 8, 0 },
+	{ 1, 2, 3, 4, 5, 0, 0, 0 },
+	{ 1, 2, 3, 4, 5, 8, 0, 0 },
+	{ 1, 2, 3, 4, 5, 7, 0, 0 },
+	{ 1, 2, 3, 4, 5, 7, 8, 0 },
+	{ 1, 2, 3, 4, 5, 6, 0, 0 },
+	{ 1, 2, 3, 4, 5, 6, 8, 0 },
+	{ 1, 2, 3, 4, 5, 6, 7, 0 },
+	{ 1, 2, 3, 4, 5, 6, 7, 8 },
+};
+
+/*
+ * Turn a mask of misplaced elements in a block into block partition
+ * offsets, eight at a time with no branches. The offsets array needs
+ * room for eight more entries than are returned.
+ */
+static inline __attribute__((always_inline)) int mask_to_offsets(uint64_t mask, uint8_t *offsets, bool right)
+{
+	int	num = 0;
+
+	for (int b = 0; b < 8; b++) {
+		int		byte_index = right ? 7 - b : b;
+		uint8_t		byte = mask >> (8 * byte_index);
+		uint64_t	o;
+
+		/*
+		 * Add the byte's base to each entry. No entry exceeds 64, so
+		 * adding it to every byte of the word can't carry.
+		 */
+		memcpy(&o, right ? mask_offsets_desc[byte] : mask_offsets_asc[byte], sizeof(o));
+		o += UINT64_C(0x0101010101010101) * (right ? 56 - 8 * byte_index : 8 * byte_index);
+		memcpy(&offsets[num], &o, sizeof(o));
+		num += __builtin_popcount(byte);
+	}
+
+	return num;
+}
+
+/*
+ * Settle, with the comparator, which of the elements starting at start
+ * whose keys tie with the pivot's, as set in ties, are misplaced.
+ */
+static inline __attribute__((always_inline)) uint64_t classify_ties(lst_t *lst, layout_t layout, lst_index_t start,
+								    uint64_t ties, void *pivot, bool right)
+{
+	uint64_t	mask = 0;
+
+	while (ties) {
+		int	i = __builtin_ctzll(ties);
+		int	cmp = lst->cmp(item(lst, layout, start + i), pivot);
+
+		mask |= (uint64_t)(right ? cmp <= 0 : cmp >= 0) << i;
+		ties &= ties - 1;
+	}
+	return mask;
+}
+
+/*
+ * Classify n (<= 64) contiguous elements starting at start by their cached
+ * keys, as the keyed kernels do. The loop is branch free, so the compiler
+ * can vectorize it; only elements whose keys equal the pivot's need the
+ * comparator.
+ */
+static inline __attribute__((always_inline)) uint64_t classify_cached(lst_t *lst, layout_t layout, lst_index_t start,
+								      int n, void *pivot, uint64_t pivot_key, bool right)
+{
+	uint64_t const	*keys = &item_key(lst, layout, start);
+	uint64_t	mask = 0, ties = 0;
+
+	for (int i = 0; i < n; i++) {
+		mask |= (uint64_t)(right ? keys[i] < pivot_key : keys[i] > pivot_key) << i;
+		ties |= (uint64_t)(keys[i] == pivot_key) << i;
+	}
+
+	return mask | classify_ties(lst, layout, start, ties, pivot, right);
+}
+
+/*
+ * Scan a block of the block partition, recording in offsets the offsets of
+ * the elements on the wrong side of the pivot, and returning how many there
+ * are. The left block is [first, first + size), and offsets i count up from
+ * first. The right block is [last - size, last), and offsets i count down
+ * from last, so they name last - i.
+ */
+static inline __attribute__((always_inline)) int block_scan(lst_t *lst, layout_t layout, lst_index_t base, int size,
+							    void *pivot, bool keyed, lst_key_t pivot_key, uint8_t *offsets,
+							    bool right)
+{
+	lst_index_t	start = right ? base - size : base;
+	int		num = 0;
+	bool		cached = lst->key_project != NULL;
+	bool		prefetch = lst->prefetch && !cached;
+
+	/*
+	 * With cached keys, the same, but from the cache; if the block wraps
+	 * around, the comparator loop below still uses the cached keys.
+	 */
+	if (cached) {
+		if (is_contiguous(lst, layout, start, size)) {
+			uint64_t	mask = classify_cached(lst, layout, start, size, pivot, pivot_key.u64, right);
+
+			return mask_to_offsets(right ? mask << (64 - size) : mask, offsets, right);
+		}
+		keyed = false;
+	}
+
+	/*
+	 * With a key, classify the block all at once, if it doesn't wrap
+	 * around the end of the circular array. Right blocks are shifted to
+	 * end at bit 63 so that the offsets come out right.
+	 */
+	if (keyed && is_contiguous(lst, layout, start, size)) {
+		uint64_t	ties;
+		uint64_t	mask = lst->classify(&item(lst, layout, start), size, lst->key_type, lst->key_offset,
+						     pivot_key, right, &ties);
+
+		mask |= classify_ties(lst, layout, start, ties, pivot, right);
+		return mask_to_offsets(right ? mask << (64 - size) : mask, offsets, right);
+	}
+
+	if (keyed) {
+		for (int i = 0; i < size; i++) {
+			void	*data = item(lst, layout, right ? base - i - 1 : base + i);
+			int	cmp = key_cmp(lst->key_type, data, lst->key_offset, pivot_key);
+
+			if (cmp == 0) cmp = lst->cmp(data, pivot);
+			offsets[num] = right ? i + 1 : i;
+			num += right ? cmp <= 0 : cmp >= 0;
+		}
+		return num;
+	}
+
+	for (int i = 0; i < size; i++) {
+		if (right) {
+			prefetch_compare(lst, prefetch, layout, base - i - 1 - PREFETCH_DISTANCE, start, base - 1);
+			offsets[num] = i + 1;
+			num += item_cmp(lst, cached, layout, base - i - 1, pivot, pivot_key.u64) <= 0;
+		} else {
+			prefetch_compare(lst, prefetch, layout, base + i + PREFETCH_DISTANCE, base, base + size - 1);
+			offsets[num] = i;
+			num += item_cmp(lst, cached, layout, base + i, pivot, pivot_key.u64) >= 0;
+		}
+	}
+	return num;
+}
+
+/*
+ * Swap the misplaced elements at the offsets from first with those at the
+ * offsets back from last, num of each. Their offsets say which elements
+ * the swaps will write the indexes of well before they get to them.
+ */
+static inline __attribute__((always_inline, nonnull)) void block_swap(lst_t *lst, bool cached, bool prefetch,
+								     layout_t layout, lst_index_t first,
+								     uint8_t const *offsets_l, lst_index_t last,
+								     uint8_t const *offsets_r, lst_index_t num)
+{
+	for (lst_index_t i = 0; i < num; i++) {
+		if (i + PREFETCH_DISTANCE < num) {
+			prefetch_index(lst, prefetch, layout, first + offsets_l[i + PREFETCH_DISTANCE]);
+			prefetch_index(lst, prefetch, layout, last - offsets_r[i + PREFETCH_DISTANCE]);
+		}
+		lst_swap(lst, cached, layout, first + offsets_l[i], last - offsets_r[i]);
+	}
+}
+
+/*
+ * Block partition of [low, high] around the pivot, which the caller has
+ * placed at low, after Edelkamp and Weiss, "BlockQuicksort: Avoiding Branch
+ * Mispredictions in Quicksort", with the tail handling from pdqsort.
+ *
+ * Rather than branching on each comparison, we record the offsets of
+ * misplaced elements in a block from each end, unconditionally bumping the
+ * count by the comparison outcome, and then swap pairs of them. As with
+ * Hoare, elements equal to the pivot count as misplaced on both sides, so
+ * runs of duplicates still split evenly.
+ *
+ * If keyed is set, the blocks are classified by the LST's keyed, possibly
+ * SIMD, kernel instead of the comparator. LSTs that cache keys classify
+ * by those instead.
+ */
+static inline __attribute__((always_inline, nonnull)) void partition_block(lst_t *lst, lst_index_t low, lst_index_t high,
+									  void *pivot, bool keyed, layout_t layout)
+{
+	uint8_t		offsets_l[PARTITION_BLOCK_SIZE + 8], offsets_r[PARTITION_BLOCK_SIZE + 8];
+	lst_index_t	first = low + 1, last = high + 1;
+	lst_index_t	num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+	lst_index_t	num, unknown, l_size, r_size;
+	lst_key_t	pivot_key = { 0 };
+	bool		cached = lst->key_project != NULL;
+	bool		prefetch = lst->prefetch;
+
+	if (cached) {
+		pivot_key.u64 = item_key(lst, layout, low);
+	} else if (keyed) {
+		pivot_key = key_load(lst->key_type, pivot, lst->key_offset);
+	}
+
+	while (last - first > 2 * PARTITION_BLOCK_SIZE) {
+		if (num_l == 0) {
+			start_l = 0;
+			num_l = block_scan(lst, layout, first, PARTITION_BLOCK_SIZE, pivot, keyed, pivot_key, offsets_l, false);
+		}
+		if (num_r == 0) {
+			start_r = 0;
+			num_r = block_scan(lst, layout, last, PARTITION_BLOCK_SIZE, pivot, keyed, pivot_key, offsets_r, true);
+		}
+
+		num = (num_l < num_r) ? num_l : num_r;
+		block_swap(lst, cached, prefetch, layout, first, offsets_l + start_l, last, offsets_r + start_r, num);
+		num_l -= num;
+		num_r -= num;
+		start_l += num;
+		start_r += num;
+		if (num_l == 0) first += PARTITION_BLOCK_SIZE;
+		if (num_r == 0) last -= PARTITION_BLOCK_SIZE;
+	}
+
+	/*
+	 * At most one side has a partly used block; split whatever is left
+	 * unexamined between that block and one more on the other side.
+	 */
+	unknown = (last - first) - ((num_l || num_r) ? PARTITION_BLOCK_SIZE : 0);
+	if (num_r) {
+		l_size = unknown;
+		r_size = PARTITION_BLOCK_SIZE;
+	} else if (num_l) {
+		l_size = PARTITION_BLOCK_SIZE;
+		r_size = unknown;
+	} else {
+		l_size = unknown / 2;
+		r_size = unknown - l_size;
+	}
+
+	if (unknown && num_l == 0) {
+		start_l = 0;
+		num_l = block_scan(lst, layout, first, l_size, pivot, keyed, pivot_key, offsets_l, false);
+	}
+	if (unknown && num_r == 0) {
+		start_r = 0;
+		num_r = block_scan(lst, layout, last, r_size, pivot, keyed, pivot_key, offsets_r, true);
+	}
+
+	num = (num_l < num_r) ? num_l : num_r;
+	block_swap(lst, cached, prefetch, layout, first, offsets_l + start_l, last, offsets_r + start_r, num);
+	num_l -= num;
+	num_r -= num;
+	start_l += num;
+	start_r += num;
+	if (num_l == 0) first += l_size;
+	if (num_r == 0) last -= r_size;
+
+	/*
+	 * Any elements still misplaced are all on one side; move them
+	 * to the boundary.
+	 */
+	if (num_l) {
+		while (num_l--) lst_swap(lst, cached, layout, first + offsets_l[start_l + num_l], --last);
+		first = last;
+	}
+	if (num_r) {
+		while (num_r--) lst_swap(lst, cached, layout, last - offsets_r[start_r + num_r], first++);
+	}
+
+	/*
+	 * Now [low + 1, first) <= pivot and [first, high] >= pivot, so the
+	 * pivot belongs at first - 1.
+	 */
+	if (first - 1 != low) lst_swap(lst, cached, layout, low, first - 1);
+	stack_push(&lst->s, first - 1, location_key(lst, cached, layout, first - 1));
+}
+
+/*
+ * Exchange n elements starting at a with n elements starting at b.
+ */
+static inline __attribute__((always_inline, nonnull)) void lst_swap_range(lst_t *lst, bool cached, layout_t layout,
+									  lst_index_t a, lst_index_t b, lst_index_t n)
+{
+	for (lst_index_t i = 0; i < n; i++) lst_swap(lst, cached, layout, a + i, b + i);
+}
+
+/*
+ * Three-way partition of [low, high] around the pivot, which the caller has
+ * placed at low, into [< pivot][== pivot][> pivot].
+ *
+ * This is Bentley and McIlroy's scheme: a Hoare-style scan that parks
+ * elements equal to the pivot at either end and swaps them into the middle
+ * afterwards, so unlike Dijkstra's version it doesn't swap every element
+ * smaller than the pivot.
+ *
+ * The ends of the middle run become pivots, and the bucket between them,
+ * holding the rest of the run, is marked BUCKET_EQUAL so that pops can
+ * drain it without any comparisons.
+ */
+static inline __attribute__((always_inline, nonnull)) void partition_three_way(lst_t *lst, lst_index_t low,
+									      lst_index_t high, void *pivot, bool cached,
+									      layout_t layout)
+{
+	lst_index_t	a = low + 1, b = low + 1, c = high, d = high;
+	lst_index_t	n, lt, gt;
+	uint64_t	pivot_key = location_key(lst, cached, layout, low);
+	int		cmp;
+
+	for (;;) {
+		while (b <= c && (cmp = item_cmp(lst, cached, layout, b, pivot, pivot_key)) <= 0) {
+			if (cmp == 0) lst_swap(lst, cached, layout, a++, b);
+			b++;
+		}
+		while (b <= c && (cmp = item_cmp(lst, cached, layout, c, pivot, pivot_key)) >= 0) {
+			if (cmp == 0) lst_swap(lst, cached, layout, c, d--);
+			c--;
+		}
+		if (b > c) break;
+		lst_swap(lst, cached, layout, b++, c--);
+	}
+
+	/*
+	 * Now [low, a) == pivot, [a, b) < pivot, (c, d] > pivot, (d, high] == pivot.
+	 */
+	n = (a - low < b - a) ? a - low : b - a;
+	lst_swap_range(lst, cached, layout, low, b - n, n);
+	n = (d - c < high - d) ? d - c : high - d;
+	lst_swap_range(lst, cached, layout, b, high + 1 - n, n);
+
+	lt = low + (b - a);
+	gt = high - (d - c);
+
+	/*
+	 * The stack grows leftwards through the array, so push the right end first.
+	 */
+	if (stack_push(&lst->s, gt, location_key(lst, cached, layout, gt)) < 0 || lt == gt) return;
+	if (stack_push(&lst->s, lt, location_key(lst, cached, layout, lt)) < 0) return;
+	stack_set_order(&lst->s, stack_depth(&lst->s) - 2, BUCKET_EQUAL);
+}
+
+/*
+ * Make sure the scratch arrays used by the multi-way partition hold at
+ * least n elements.
+ */
+static bool scratch_reserve(lst_t *lst, lst_index_t n)
+{
+	void		**n_scratch;
+	uint8_t		*n_oracle;
+
+	if (n <= lst->scratch_size) return true;
+
+	n_scratch = realloc(lst->scratch, sizeof(void *) * n);
+	if (unlikely(!n_scratch)) return false;
+	lst->scratch = n_scratch;
+
+	n_oracle = realloc(lst->oracle, sizeof(uint8_t) * n);
+	if (unlikely(!n_oracle)) return false;
+	lst->oracle = n_oracle;
+
+	lst->scratch_size = n;
+	return true;
+}
+
+/*
+ * Multi-way partition of the bucket [low, high], after Sanders and Winkel,
+ * "Super Scalar Sample Sort".
+ *
+ * A random sample of the bucket is sorted, and every oversample'th
+ * element of it becomes a splitter; the k - 1 splitters go in an implicit
+ * binary search tree. Every other element is classified by descending the
+ * tree, which takes log2(k) comparisons with no unpredictable branches,
+ * and is then copied to its bucket's place in a scratch array, and from
+ * there back to the LST. Each element is moved, but its index is written
+ * only once. The splitters land between the buckets, and all
+ * k - 1 of them are pushed as pivots at once, leaving the LST as it would
+ * be after log2(k) levels of ordinary partitioning.
+ *
+ * Returns false, having pushed nothing, if the scratch arrays can't be had.
+ */
+static inline __attribute__((always_inline, nonnull)) bool partition_multiway(lst_t *lst, lst_index_t low,
+									      lst_index_t high, layout_t layout)
+{
+	int		k = lst->multiway, log_k = __builtin_ctz(lst->multiway);
+	int		sample_size = MULTIWAY_OVERSAMPLE * k - 1;
+	lst_index_t	n = high + 1 - low, m;
+	void		*tree[MULTIWAY_MAX];
+	lst_index_t	count[MULTIWAY_MAX] = { 0 }, next[MULTIWAY_MAX];
+	lst_index_t	pos;
+	bool		cached = false;	/* LSTs that cache keys don't partition multi-way */
 
-	pivot_index = low + rand() % (high + 1 - low);
-	pivot = item(lst, pivot_index);
-
-	if (pivot_index != low) {
-		lst_move(lst, pivot_index, item(lst, low));
-		lst_move(lst, low, pivot);
+	if (!scratch_reserve(lst, n)) return false;
+
+	/*
+	 * Draw the sample without replacement by partially shuffling it
+	 * into [low, low + sample_size), and insertion sort it there.
+	 */
+	for (int i = 0; i < sample_size; i++) {
+		lst_swap(lst, cached, layout, low + i, low + i + lst_rand_range(lst, n - i));
+	}
+	for (int i = 1; i < sample_size; i++) {
+		for (int j = i; j > 0 && lst->cmp(item(lst, layout, low + j), item(lst, layout, low + j - 1)) < 0; j--) {
+			lst_swap(lst, cached, layout, low + j, low + j - 1);
+		}
 	}
 
 	/*
-	 * Hoare partition; on the average, it does a third the swaps of
-	 * Lomuto.
+	 * Move the splitters, in order, to [low, low + k - 1). Each one moves
+	 * down past only those already moved, so none is disturbed.
 	 */
-	l = low - 1;
-	h = high + 1;
-	for (;;) {
-		while (lst->cmp(item(lst, --h), pivot) > 0) ;
-		while (lst->cmp(item(lst, ++l), pivot) < 0) ;
-		if (l >= h) break;
-		temp = item(lst, l);
-		lst_move(lst, l, item(lst, h));
-		lst_move(lst, h, temp);
+	for (int j = 0; j < k - 1; j++) lst_swap(lst, cached, layout, low + j, low + (j + 1) * MULTIWAY_OVERSAMPLE - 1);
+
+	/*
+	 * Lay the splitters out as an implicit tree: the children of tree[i]
+	 * are tree[2i] and tree[2i + 1], and tree[1] is the median.
+	 */
+	for (int level = 0, width = 1; level < log_k; level++, width *= 2) {
+		for (int i = 0; i < width; i++) {
+			tree[width + i] = item(lst, layout, low + (2 * i + 1) * (k >> (level + 1)) - 1);
+		}
 	}
 
 	/*
-	 * Hoare partition doesn't guarantee the pivot sits at location h
-	 * the way Lomuto does and LST needs, so first get its location...
+	 * Classify the rest. Elements equal to a splitter go to its left.
+	 * LSTs with keys descend a tree of the splitters' keys instead, which
+	 * needs the comparator only for keys equal to a splitter's, since it
+	 * may order those by more than the key.
 	 */
-	pivot_index = item_index(lst, pivot);
-	if (pivot_index >= index_reduce(lst, low)) {
-		pivot_index = low + pivot_index - index_reduce(lst, low);
-	} else {
-		pivot_index = high - (index_reduce(lst, high) - pivot_index);
+	m = n - (k - 1);
+	switch (lst->key_type) {
+	case LST_KEY_NONE:
+		for (lst_index_t i = 0; i < m; i++) {
+			void	*data = item(lst, layout, low + k - 1 + i);
+			int	b = 1;
+
+			for (int level = 0; level < log_k; level++) b = 2 * b + (lst->cmp(data, tree[b]) > 0);
+			lst->oracle[i] = b - k;
+		}
+		break;
+
+#define CLASSIFY_KEYED(_type, _field) \
+	do { \
+		_type	keys[MULTIWAY_MAX]; \
+		for (int b = 1; b < k; b++) keys[b] = key_load(lst->key_type, tree[b], lst->key_offset)._field; \
+		for (lst_index_t i = 0; i < m; i++) { \
+			void	*data = item(lst, layout, low + k - 1 + i); \
+			_type	key = key_load(lst->key_type, data, lst->key_offset)._field; \
+			int	b = 1; \
+			for (int level = 0; level < log_k; level++) { \
+				b = 2 * b + (key == keys[b] ? lst->cmp(data, tree[b]) > 0 : key > keys[b]); \
+			} \
+			lst->oracle[i] = b - k; \
+		} \
+	} while (0)
+
+	case LST_KEY_INT32:
+		CLASSIFY_KEYED(int32_t, i32);
+		break;
+
+	case LST_KEY_INT64:
+		CLASSIFY_KEYED(int64_t, i64);
+		break;
+
+	case LST_KEY_DOUBLE:
+		CLASSIFY_KEYED(double, d);
+		break;
+#undef CLASSIFY_KEYED
+	}
+	for (lst_index_t i = 0; i < m; i++) count[lst->oracle[i]]++;
+
+	/*
+	 * Bucket b starts after buckets 0..b-1 and the b splitters between them.
+	 */
+	pos = 0;
+	for (int b = 0; b < k; b++) {
+		next[b] = pos;
+		pos += count[b];
+		if (b < k - 1) lst->scratch[pos++] = item(lst, layout, low + b);
 	}
 
 	/*
-	 * ...and then move it if need be.
+	 * Each element's final position is known as it's scattered, so set
+	 * its index then, visiting the elements in array order rather than
+	 * in the scattered order of the copy back.
 	 */
-	if (pivot_index < h) {
-		lst_move(lst, pivot_index, item(lst, h));
-		lst_move(lst, h, pivot);
+	for (int b = 0; is_indexed(layout) && b < k - 1; b++) {
+		item_index(lst, lst->scratch[next[b] + count[b]]) = index_reduce(lst, layout, low + next[b] + count[b]);
 	}
-	if (pivot_index > h) {
-		h++;
-		lst_move(lst, pivot_index, item(lst, h));
-		lst_move(lst, h, pivot);
+	for (lst_index_t i = 0; i < m; i++) {
+		void		*data = item(lst, layout, low + k - 1 + i);
+		lst_index_t	dest = next[lst->oracle[i]]++;
+
+		lst->scratch[dest] = data;
+		if (is_indexed(layout)) item_index(lst, data) = index_reduce(lst, layout, low + dest);
 	}
 
-	stack_push(&lst->s, h);
+	for (lst_index_t i = 0; i < n; i++) item(lst, layout, low + i) = lst->scratch[i];
+
+	/*
+	 * Bucket b now ends at next[b], where splitter b + 1 sits. The stack
+	 * grows leftwards through the array, so push the rightmost first.
+	 */
+	for (int b = k - 2; b >= 0; b--) {
+		if (stack_push(&lst->s, low + next[b], location_key(lst, cached, layout, low + next[b])) < 0) break;
+	}
+	return true;
 }
 
 /*
- * Delete an item from a bucket in an LST
+ * Partition an LST
+ * It's only called for trees that are a single nonempty bucket;
+ * if it's a subtree, it is thus necessarily the leftmost.
  */
-static void bucket_delete(lst_t *lst, stack_index_t stack_index, void *data)
+static inline __attribute__((always_inline, nonnull)) void _partition(lst_t *lst, stack_index_t stack_index,
+								     layout_t layout)
+{
+	lst_index_t	low = bucket_lwb(lst, stack_index);
+	lst_index_t	high = bucket_upb(lst, stack_index);
+	lst_index_t	pivot_index;
+	void		*pivot;
+	bool		cached = lst->key_project != NULL;
+	bool		keyed = (lst->key_type != LST_KEY_NONE || cached) && high - low >= KEYED_PARTITION_MIN;
+
+	/*
+	 * The partition kernels don't do the trivial case, so catch it here.
+	 */
+	if (is_equivalent(lst, layout, low, high)) {
+		stack_push(&lst->s, low, location_key(lst, cached, layout, low));
+		return;
+	}
+
+	if (lst->bad_splits >= INTROSELECT_BAD_SPLITS && high + 1 - low >= INTROSELECT_MIN) {
+		pivot_index = mom_select(lst, low, high, (high - low) / 2);
+		stack_push(&lst->s, pivot_index, location_key(lst, cached, layout, pivot_index));
+		split_note(lst, stack_index, low, high);
+		return;
+	}
+
+	if (lst->multiway && high + 1 - low >= MULTIWAY_PARTITION_MIN && partition_multiway(lst, low, high, layout)) {
+		split_note(lst, stack_index, low, high);
+		return;
+	}
+
+	pivot_index = pivot_select(lst, low, high);
+	pivot = item(lst, layout, pivot_index);
+
+	if (pivot_index != low) lst_swap(lst, cached, layout, pivot_index, low);
+
+	/*
+	 * The block partition is the biggest kernel, so there's just the
+	 * one call to it, for the block scheme and for keyed partitions.
+	 */
+	if (lst->partition == LST_PARTITION_THREE_WAY) {
+		if (cached) {
+			partition_three_way(lst, low, high, pivot, true, layout);
+		} else {
+			partition_three_way(lst, low, high, pivot, false, layout);
+		}
+	} else if (lst->partition == LST_PARTITION_BLOCK || keyed) {
+		partition_block(lst, low, high, pivot, keyed, layout);
+	} else if (cached) {
+		partition_hoare(lst, low, high, pivot, true, false, layout);
+	} else if (lst->prefetch) {
+		partition_hoare(lst, low, high, pivot, false, true, layout);
+	} else {
+		partition_hoare(lst, low, high, pivot, false, false, layout);
+	}
+	split_note(lst, stack_index, low, high);
+}
+
+static void partition(lst_t *lst, stack_index_t stack_index)
+{
+	LAYOUT_SPECIALIZE(lst, _partition(lst, stack_index, layout));
+}
+
+/*
+ * Delete an item, at location, from a bucket in an LST
+ */
+static inline __attribute__((always_inline, nonnull)) void bucket_delete(lst_t *lst, stack_index_t stack_index,
+									void *data, lst_index_t location, layout_t layout)
 {
-	lst_index_t	location = item_index(lst, data);
 	lst_index_t	top;
+	bool		cached = lst->key_project != NULL;
+	bool		prefetch = lst->prefetch;
 
-	if (is_equivalent(lst, location, lst->idx)) {
+	if (is_equivalent(lst, layout, location, lst->idx)) {
 		lst->idx++;
-		if (is_equivalent(lst, lst->idx, 0)) lst_indices_reduce(lst);
+		if (lst->idx >= lst->modulus) lst_indices_reduce(lst);
 	} else {
 		for (;;) {
+			if (prefetch && stack_index >= 2 * PREFETCH_PIVOTS) {
+				prefetch_slot(lst, prefetch, cached, layout, stack_item(&lst->s, stack_index - 2 * PREFETCH_PIVOTS) - 1);
+			}
+			if (prefetch && stack_index >= PREFETCH_PIVOTS) {
+				prefetch_index(lst, prefetch, layout, stack_item(&lst->s, stack_index - PREFETCH_PIVOTS) - 1);
+				if (stack_index > PREFETCH_PIVOTS) {
+					prefetch_index(lst, prefetch, layout, stack_item(&lst->s, stack_index - PREFETCH_PIVOTS));
+				}
+			}
 			top = bucket_upb(lst, stack_index);
-			if (!is_equivalent(lst, location, top)) lst_move(lst, location, item(lst, top));
+			if (!is_equivalent(lst, layout, location, top)) {
+				lst_copy(lst, cached, layout, location, top);
+				if (stack_order(&lst->s, stack_index) == BUCKET_SORTED) {
+					stack_set_order(&lst->s, stack_index, BUCKET_UNORDERED);
+				}
+			}
 			stack_set(&lst->s, stack_index, top);
 			if (stack_index == 0) break;
-			lst_move(lst, top, item(lst, top + 1));
+			lst_copy(lst, cached, layout, top, top + 1);
 			stack_index--;
 			location = top + 1;
 		}
 	}
 
 	lst->num_elements--;
+	if (is_indexed(layout)) item_index(lst, data) = -1;
+}
+
+/*
+ * Not in the paper: lazy deletion. With lazy_delete set, extracting an
+ * element from an unordered bucket other than the leftmost just leaves a
+ * tombstone in its place, rather than moving an element of every bucket
+ * to the right to close the gap. Tombstones only stay in unordered
+ * buckets, never as pivots, and moves never take them from one bucket to
+ * another, so the buckets from clean_from up stay free of them. Before a
+ * pop or peek looks at the leftmost bucket, or partitions or sorts it,
+ * bucket_compact_top() drops any tombstones in it; and should they build
+ * up elsewhere, lst_compact() drops all of them.
+ */
+static inline __attribute__((always_inline, nonnull)) bool is_tombstone(lst_t *lst, layout_t layout,
+									lst_index_t location)
+{
+	return item(lst, layout, location) == lst->tombstone;
+}
+
+/*
+ * Drop the tombstones from the leftmost bucket, filling each from the
+ * bucket's left end, which then shrinks; that moves one element per
+ * tombstone rather than all of them.
+ */
+static void bucket_compact_top(lst_t *lst, stack_index_t stack_index)
+{
+	lst_index_t	at = stack_item(&lst->s, stack_index) - 1;
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+
+	while (at >= lst->idx) {
+		if (!is_tombstone(lst, layout, at)) {
+			at--;
+			continue;
+		}
+
+		/*
+		 * If what's at the left end is a tombstone too, at still
+		 * holds one afterwards, so look at it again.
+		 */
+		if (at != lst->idx) lst_copy(lst, cached, layout, at, lst->idx);
+		lst->idx++;
+		lst->tombstones--;
+		lst->num_elements--;
+	}
+
+	lst->clean_from = stack_index;
+	if (lst->idx >= lst->modulus) lst_indices_reduce(lst);
+}
+
+/*
+ * Drop every tombstone, moving elements and pivots left to close the gaps.
+ */
+static void lst_compact(lst_t *lst)
+{
+	stack_index_t	stack_index = stack_depth(&lst->s) - 1;
+	lst_index_t	end = stack_item(&lst->s, 0);
+	lst_index_t	to = lst->idx;
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+
+	for (lst_index_t from = lst->idx; from < end; from++) {
+		if (stack_index > 0 && from == stack_item(&lst->s, stack_index)) {
+			stack_set(&lst->s, stack_index--, to);
+		} else if (is_tombstone(lst, layout, from)) {
+			continue;
+		}
+		if (to != from) lst_copy(lst, cached, layout, to, from);
+		to++;
+	}
+	stack_set(&lst->s, 0, to);
+
+	lst->num_elements -= lst->tombstones;
+	lst->tombstones = 0;
+	lst->clean_from = 0;
+}
+
+/*
+ * Delete data from an unordered bucket in O(1): from the leftmost bucket,
+ * by moving its first element into data's place, and from any other by
+ * leaving a tombstone.
+ */
+static void bucket_delete_lazy(lst_t *lst, stack_index_t stack_index, void *data, layout_t layout)
+{
+	lst_index_t	location = item_index(lst, data);
+
+	if (is_bucket(lst, stack_index)) {
+		if (!is_equivalent(lst, layout, location, lst->idx)) lst_copy(lst, lst->key_project != NULL, layout, location, lst->idx);
+		lst->idx++;
+		if (lst->idx >= lst->modulus) lst_indices_reduce(lst);
+		lst->num_elements--;
+	} else {
+		item(lst, layout, location) = lst->tombstone;
+		if (stack_index >= lst->clean_from) lst->clean_from = stack_index + 1;
+		if (++lst->tombstones > lst->num_elements * lst->lazy_delete) lst_compact(lst);
+	}
 	item_index(lst, data) = -1;
 }
 
+/*
+ * Insertion sort n elements starting at low; cached says whether the LST
+ * caches keys, and layout how it lays them out.
+ */
+static inline __attribute__((always_inline, nonnull)) void bucket_sort(lst_t *lst, lst_index_t low, lst_index_t n,
+								      bool cached, layout_t layout)
+{
+	for (lst_index_t i = 1; i < n; i++) {
+		void		*data = item(lst, layout, low + i);
+		uint64_t	key = location_key(lst, cached, layout, low + i);
+		lst_index_t	j;
+
+		for (j = i; j > 0 && item_cmp(lst, cached, layout, low + j - 1, data, key) > 0; j--) lst_copy(lst, cached, layout, low + j, low + j - 1);
+		if (j != i) lst_place(lst, cached, layout, low + j, data, key);
+	}
+}
+
+/*
+ * Not in the paper: see whether the first element of the (nonempty)
+ * leftmost bucket is a minimum, so that pops and peeks can use it
+ * directly instead of partitioning.
+ *
+ * It is if the bucket is known to be all equal or sorted. If not, but the
+ * bucket is small, sorting it costs about what partitioning it would,
+ * and it then serves the following pops and peeks with no comparisons
+ * until an insert lands inside it.
+ */
+static inline __attribute__((always_inline, nonnull)) bool bucket_head_is_min(lst_t *lst, stack_index_t stack_index,
+									      layout_t layout)
+{
+	lst_index_t	size;
+
+	if (stack_order(&lst->s, stack_index) != BUCKET_UNORDERED) return true;
+
+	size = lst_size(lst, layout, stack_index);
+	if (size > lst->sort_threshold) return false;
+
+	if (lst->key_project) {
+		bucket_sort(lst, lst->idx, size, true, layout);
+	} else {
+		bucket_sort(lst, lst->idx, size, false, layout);
+	}
+	stack_set_order(&lst->s, stack_index, BUCKET_SORTED);
+	return true;
+}
+
 /*
  * We precede each function that does the real work with a Pythonish
  * (but colon-free) version of the pseudocode from the paper.
  *
- * clang, in version 13, will have a way to force tail call optimization
- * with a "musttail" attribute. gcc has -f-foptimize-sibling-calls, but
- * it works only with -O[23s]. For now, -O2 will assure TCO. In its absence,
- * the recursion depth is bounded by the number of pivot stack entries, aka
- * the "length" of the LST, which has an expected value proportional to
- * log(number of nodes).
+ * The pseudocode is recursive, but each recursive call is a tail call
+ * on the left subtree, i.e. on the next stack index, so the functions
+ * are written as the loops the calls would become. That way they
+ * don't depend on the compiler doing tail call optimization, which gcc
+ * only does at -O2 and above, and debug builds behave like release builds.
  */
 
 /*
@@ -491,19 +3369,39 @@ static void bucket_delete(lst_t *lst, stack_index_t stack_index, void *data)
  *		Return r
  *	Else
  *		Return ExtractMin(L)
+ *
+ * Only the subtree rooted at the top pivot can have an empty left
+ * subtree, and the descent ends in the leftmost bucket otherwise, so
+ * rather than walk down the stack we can start at its top.
  */
-static inline __attribute__((nonnull)) void *_lst_pop(lst_t *lst, stack_index_t stack_index)
+static inline __attribute__((always_inline, nonnull)) void *_lst_pop(lst_t *lst, layout_t layout)
 {
-	if (is_bucket(lst, stack_index)) partition(lst, stack_index);
-	++stack_index;
-	if (lst_size(lst, stack_index) == 0) {
-		void	*min = pivot_item(lst, stack_index);
+	for (;;) {
+		stack_index_t	stack_index = stack_depth(&lst->s) - 1;
 
-		lst_flatten(lst, stack_index);
-		bucket_delete(lst, stack_index, min);
-		return min;
+		if (unlikely(lst->tombstones > 0) && stack_index < lst->clean_from) bucket_compact_top(lst, stack_index);
+
+		if (stack_index > 0 && lst_size(lst, layout, stack_index) == 0) {
+			lst_index_t	location = stack_item(&lst->s, stack_index);
+			void		*min = item(lst, layout, location);
+
+			/*
+			 * Flattening here only absorbs the empty bucket, so the
+			 * bucket below keeps what we know about its order.
+			 */
+			stack_pop(&lst->s, 1);
+			bucket_delete(lst, stack_index, min, location, layout);
+			return min;
+		}
+
+		if (bucket_head_is_min(lst, stack_index, layout)) {
+			void	*min = item(lst, layout, lst->idx);
+
+			bucket_delete(lst, stack_index, min, lst->idx, layout);
+			return min;
+		}
+		partition(lst, stack_index);
 	}
-	return _lst_pop(lst, stack_index);
 }
 
 /*
@@ -515,13 +3413,146 @@ static inline __attribute__((nonnull)) void *_lst_pop(lst_t *lst, stack_index_t
  *		Return r
  *	Else
  *		Return FindMin(L)
+ *
+ * As with ExtractMin(), we can start at the top of the stack.
+ */
+static inline __attribute__((always_inline, nonnull)) void *_lst_peek(lst_t *lst, layout_t layout)
+{
+	for (;;) {
+		stack_index_t	stack_index = stack_depth(&lst->s) - 1;
+
+		if (unlikely(lst->tombstones > 0) && stack_index < lst->clean_from) bucket_compact_top(lst, stack_index);
+
+		if (stack_index > 0 && lst_size(lst, layout, stack_index) == 0) return pivot_item(lst, layout, stack_index);
+		if (bucket_head_is_min(lst, stack_index, layout)) return item(lst, layout, lst->idx);
+		partition(lst, stack_index);
+	}
+}
+
+/*
+ * The smallest stack index whose pivot isn't right of location, or the
+ * stack depth if they all are. Elements know where they are, and pivots
+ * descend through the array with stack index, so unlike insert_level()
+ * this needs no comparisons at all: it searches the pivots' offsets from
+ * idx for location's, galloping and then binary searching the same way.
+ */
+static inline __attribute__((always_inline, nonnull)) stack_index_t extract_level(lst_t *lst, layout_t layout,
+										     lst_index_t location)
+{
+	stack_index_t	depth = stack_depth(&lst->s);
+	lst_index_t	offset = offset_reduce(lst, layout, location - lst->idx);
+	stack_index_t	low = 0;
+	stack_index_t	n = 1;
+
+#define pivot_offset(_k)	offset_reduce(lst, layout, stack_item(&lst->s, (_k)) - lst->idx)
+	while (low + n < depth && pivot_offset(low + n) > offset) {
+		low += n;
+		n <<= 1;
+	}
+	if (low + n > depth) n = depth - low;
+
+	while (n > 1) {
+		stack_index_t	half = n >> 1;
+
+		low += (pivot_offset(low + half) > offset) * half;
+		n -= half;
+	}
+#undef pivot_offset
+	return low + 1;
+}
+
+/*
+ * Find the largest (if sign > 0) or smallest (if sign < 0) element of the
+ * n starting at low, skipping tombstones, and return whether there is one.
+ * If they're ordered, it's at the end or the start.
+ */
+static bool bucket_extreme(lst_t *lst, lst_index_t low, lst_index_t n, bool ordered, int sign, lst_index_t *found)
+{
+	bool		cached = lst->key_project != NULL;
+	layout_t	layout = lst->layout;
+	bool		have = false;
+	lst_index_t	best = low;
+
+	if (ordered) {
+		*found = sign > 0 ? low + n - 1 : low;
+		return true;
+	}
+
+	for (lst_index_t i = low; i < low + n; i++) {
+		if (unlikely(lst->tombstones > 0) && is_tombstone(lst, layout, i)) continue;
+		if (!have || sign * item_cmp(lst, cached, layout, i, item(lst, layout, best), location_key(lst, cached, layout, best)) > 0) {
+			best = i;
+			have = true;
+		}
+	}
+	*found = best;
+	return have;
+}
+
+/*
+ * Not in the paper: extracting the pivot at stack_index without flattening.
+ *
+ * The largest element of the bucket to the pivot's left, or the smallest
+ * of the bucket to its right, can take the pivot's place. Either is one
+ * end of its bucket if the bucket is ordered, and otherwise takes a scan
+ * of it. We move it next to the pivot and make it the pivot, which leaves
+ * the old pivot at the near end of the other bucket, to be deleted from
+ * there. If both buckets are empty, or hold only tombstones, the pivot
+ * simply goes.
+ *
+ * Flattening costs repartitioning the lst_size() elements to the pivot's
+ * left, so if a scan would cost more than that, we flatten after all.
+ *
+ * Returns the stack index of the bucket the old pivot is left in, or -1
+ * to flatten.
  */
-static inline __attribute__((nonnull)) void *_lst_peek(lst_t *lst, stack_index_t stack_index)
+static stack_index_t pivot_repair(lst_t *lst, stack_index_t stack_index)
 {
-	if (is_bucket(lst, stack_index)) partition(lst, stack_index);
-	++stack_index;
-	if (lst_size(lst, stack_index) == 0) return pivot_item(lst, stack_index);
-	return _lst_peek(lst, stack_index);
+	lst_index_t	location = stack_item(&lst->s, stack_index);
+	lst_index_t	left = location - bucket_lwb(lst, stack_index);
+	lst_index_t	right = bucket_upb(lst, stack_index - 1) - location;
+	bool		left_ordered = stack_order(&lst->s, stack_index) != BUCKET_UNORDERED;
+	bool		right_ordered = stack_order(&lst->s, stack_index - 1) != BUCKET_UNORDERED;
+	lst_index_t	left_cost = left == 0 ? lst->num_elements : left_ordered ? 1 : left;
+	lst_index_t	right_cost = right == 0 ? lst->num_elements : right_ordered ? 1 : right;
+	layout_t	layout = lst->layout;
+	bool		right_ok = right > 0 && right_cost <= lst_size(lst, layout, stack_index);
+	bool		cached = lst->key_project != NULL;
+	lst_index_t	best;
+
+	/*
+	 * Try the cheaper side first. A nonempty left bucket never costs
+	 * more than flattening, since it's part of what flattening merges.
+	 */
+	if (right_ok && right_cost < left_cost && bucket_extreme(lst, location + 1, right, right_ordered, -1, &best)) {
+		goto promote_right;
+	}
+	if (left > 0 && bucket_extreme(lst, location - left, left, left_ordered, 1, &best)) {
+		if (best != location - 1) lst_swap(lst, cached, layout, best, location - 1);
+		stack_set(&lst->s, stack_index, location - 1);
+		stack_set_key(&lst->s, stack_index, location_key(lst, cached, layout, location - 1));
+		return stack_index - 1;
+	}
+	if (right_ok && right_cost >= left_cost && bucket_extreme(lst, location + 1, right, right_ordered, -1, &best)) {
+		goto promote_right;
+	}
+	if (right > 0 && !right_ok) return -1;
+
+	/*
+	 * Nothing but tombstones either side, if that.
+	 */
+	stack_remove(&lst->s, stack_index);
+	if (left + right > 0) stack_set_order(&lst->s, stack_index - 1, BUCKET_UNORDERED);
+	if (lst->clean_from >= stack_index) {
+		lst->clean_from = lst->clean_from - 1 > stack_index ? lst->clean_from - 1 : stack_index;
+	}
+	return stack_index - 1;
+
+promote_right:
+	if (best != location + 1) lst_swap(lst, cached, layout, best, location + 1);
+	stack_set(&lst->s, stack_index, location + 1);
+	stack_set_key(&lst->s, stack_index, location_key(lst, cached, layout, location + 1));
+	return stack_index;
 }
 
 /*
@@ -538,24 +3569,84 @@ static inline __attribute__((nonnull)) void *_lst_peek(lst_t *lst, stack_index_t
  *			Flatten T into bucket(B′′) // O(1)
  *			Remove x from bucket B′′ // O(depth)
  */
-static inline __attribute__((nonnull)) void _lst_extract(lst_t *lst,  stack_index_t stack_index, void *data)
+static inline __attribute__((always_inline, nonnull)) void _lst_extract(lst_t *lst, void *data, layout_t layout)
 {
-	int8_t	cmp;
+	lst_index_t	location = item_index(lst, data);
+	stack_index_t	level = extract_level(lst, layout, location);
+	stack_index_t	stack_index = level - 1;
 
-	if (is_bucket(lst, stack_index)) {
-		bucket_delete(lst, stack_index, data);
+	/*
+	 * If data is the pivot itself, flatten as the paper does, unless
+	 * asked to repair the pivot instead, which may move it.
+	 */
+	if (level < (stack_index_t)stack_depth(&lst->s) && is_equivalent(lst, layout, stack_item(&lst->s, level), location)) {
+		stack_index = lst->preserve_pivots ? pivot_repair(lst, level) : -1;
+
+		if (stack_index < 0) {
+			lst_flatten(lst, level);
+			stack_index = level;
+		}
+		location = item_index(lst, data);
+	} else if (lst->lazy_delete > 0 && stack_order(&lst->s, stack_index) == BUCKET_UNORDERED) {
+		bucket_delete_lazy(lst, stack_index, data, layout);
 		return;
 	}
-	stack_index++;
-	cmp = lst->cmp(data, pivot_item(lst, stack_index));
-	if (cmp < 0) {
-		_lst_extract(lst, stack_index, data);
-	} else if (cmp > 0) {
-		bucket_delete(lst, stack_index - 1, data);
-	} else {
-		lst_flatten(lst, stack_index);
-		bucket_delete(lst, stack_index, data);
+	bucket_delete(lst, stack_index, data, location, layout);
+}
+
+/*
+ * Compare the pivot at a stack index with data, whose key is key if cached.
+ * Cached pivot keys live on the stack, so only ties go near the pivot itself.
+ */
+static inline __attribute__((always_inline, nonnull)) int pivot_cmp(lst_t *lst, bool cached, layout_t layout,
+								    stack_index_t stack_index, void *data, uint64_t key)
+{
+	if (cached) {
+		uint64_t	pivot_key = stack_key(&lst->s, stack_index);
+
+		if (pivot_key != key) return (pivot_key > key) - (pivot_key < key);
+	}
+	return lst->cmp(pivot_item(lst, layout, stack_index), data);
+}
+
+/*
+ * The smallest stack index whose pivot data is >= to, or the stack depth
+ * if data is less than all of them: where Insert stops descending, short
+ * of a flatten.
+ *
+ * Pivots descend with stack index, so rather than compare data with each
+ * in turn, we gallop down from the root, doubling the stride until we pass
+ * that point, then binary search the last stride without branching on the
+ * comparisons. Most inserts stop near the root, which costs them no more
+ * than the walk did; inserts far to the left of a deep stack take
+ * O(log depth) comparisons rather than O(depth).
+ */
+static inline __attribute__((always_inline, nonnull)) stack_index_t insert_level(lst_t *lst, void *data,
+										  uint64_t key, bool cached,
+										  layout_t layout)
+{
+	stack_index_t	depth = stack_depth(&lst->s);
+	stack_index_t	low = 0;
+	stack_index_t	n = 1;
+
+	/*
+	 * data is less than the pivot at low (the fictitious pivot at
+	 * index 0 is greater than everything), so the answer is in
+	 * (low, low + n].
+	 */
+	while (low + n < depth && pivot_cmp(lst, cached, layout, low + n, data, key) > 0) {
+		low += n;
+		n <<= 1;
+	}
+	if (low + n > depth) n = depth - low;
+
+	while (n > 1) {
+		stack_index_t	half = n >> 1;
+
+		low += (pivot_cmp(lst, cached, layout, low + half, data, key) > 0) * half;
+		n -= half;
 	}
+	return low + 1;
 }
 
 /*
@@ -573,23 +3664,60 @@ static inline __attribute__((nonnull)) void _lst_extract(lst_t *lst,  stack_inde
  *			Flatten T into bucket(B′) // O(1)
  *			Add x to bucket B′ // O(depth)
  */
-static inline __attribute__((nonnull)) void _lst_insert(lst_t *lst, stack_index_t stack_index, void *data)
+/*
+ * Insert's flatten decisions, for the levels 1 through last that it passes:
+ * the level to flatten at, or 0 not to flatten.
+ *
+ * The paper draws at each level k, flattening with probability
+ * 1 / (s(k) + 1), where s(k) is the size of the subtree there, and stops
+ * at the first draw that comes up. Passing levels 1 through k without
+ * flattening thus has probability S(k), the product of s(j) / (s(j) + 1)
+ * for j <= k, so a single uniform draw u decides them all: flatten at the
+ * first k for which u >= S(k). We keep S(k)'s numerator and denominator
+ * apart so as to multiply rather than divide, scaling both by a power of
+ * two, which is exact, before the denominator can overflow.
+ */
+static inline __attribute__((always_inline, nonnull)) stack_index_t insert_flatten_level(lst_t *lst,
+											  layout_t layout,
+											  stack_index_t last)
 {
-	if (is_bucket(lst, stack_index)) {
-		bucket_add(lst, stack_index, data);
-		return;
-	}
-	stack_index++;
-	if (rand() % (lst_size(lst, stack_index) + 1) != 0) {
-		if (lst->cmp(data, pivot_item(lst, stack_index)) < 0) {
-			_lst_insert(lst, stack_index, data);
-		} else {
-			bucket_add(lst, stack_index - 1, data);
+	double	u, num = 1.0, den = 1.0;
+
+	if (last < 1) return 0;
+
+	u = lst_rand_unit(lst);
+	for (stack_index_t stack_index = 1; stack_index <= last; stack_index++) {
+		lst_index_t	size = offset_reduce(lst, layout, stack_item(&lst->s, stack_index) - lst->idx);
+
+		num *= size;
+		den *= size + 1;
+		if (u * den >= num) return stack_index;
+		if (den > 0x1p512) {
+			num *= 0x1p-512;
+			den *= 0x1p-512;
 		}
-	} else {
-		lst_flatten(lst, stack_index);
-		bucket_add(lst, stack_index, data);
 	}
+	return 0;
+}
+
+/*
+ * The search replaces the comparisons of the walk, and a single draw its
+ * random draws, so the flatten decisions keep the paper's distribution.
+ */
+static inline __attribute__((always_inline, nonnull)) void _lst_insert(lst_t *lst, void *data, bool cached,
+								       layout_t layout)
+{
+	uint64_t	key = cached ? lst->key_project(data) : 0;
+	stack_index_t	level = insert_level(lst, data, key, cached, layout);
+	stack_index_t	last = level < (stack_index_t)stack_depth(&lst->s) ? level : level - 1;
+	stack_index_t	flatten = insert_flatten_level(lst, layout, last);
+	stack_index_t	stack_index = level - 1;
+
+	if (flatten) {
+		lst_flatten(lst, flatten);
+		stack_index = flatten - 1;
+	}
+	bucket_add(lst, stack_index, data, key, cached, layout);
 }
 
 /*
@@ -603,21 +3731,27 @@ static inline __attribute__((nonnull)) void _lst_insert(lst_t *lst, stack_index_
 
 void *lst_pop(lst_t *lst)
 {
-	if (unlikely(lst->num_elements == 0)) return NULL;
-	return _lst_pop(lst, 0);
+	void	*min;
+
+	if (unlikely(lst->num_elements == lst->tombstones)) return NULL;
+	LAYOUT_SPECIALIZE(lst, min = _lst_pop(lst, layout));
+	if (unlikely(lst->num_elements < lst->shrink_at)) lst_shrink(lst, 2 * lst->num_elements);
+	return min;
 }
 
 void *lst_peek(lst_t *lst)
 {
-	if (unlikely(lst->num_elements == 0)) return NULL;
-	return _lst_peek(lst, 0);
+	if (unlikely(lst->num_elements == lst->tombstones)) return NULL;
+	LAYOUT_SPECIALIZE(lst, return _lst_peek(lst, layout));
 }
 
 int lst_extract(lst_t *lst, void *data)
 {
-	if (unlikely(lst->num_elements == 0 || item_index(lst, data) < 0)) return -1;
+	if (unlikely(lst->num_elements == 0 || !is_indexed(lst->layout) || item_index(lst, data) < 0)) return -1;
 
-	_lst_extract(lst, 0, data);
+	if (unlikely(stack_too_deep(lst))) stack_rebalance(lst);
+	LAYOUT_SPECIALIZE(lst, _lst_extract(lst, data, layout));
+	if (unlikely(lst->num_elements < lst->shrink_at)) lst_shrink(lst, 2 * lst->num_elements);
 	return 1;
 }
 
@@ -627,41 +3761,118 @@ int lst_insert(lst_t *lst, void *data)
 
 	/*
 	 * Expand if need be. Not in the paper, but we want the capability.
+	 * If tombstones fill enough of the array, dropping them makes room
+	 * more cheaply; a few bucket slack leaves aren't worth a pass over
+	 * the array every few inserts, so grow unless growing fails.
+	 */
+	if (unlikely(lst->num_elements == lst->capacity)) {
+		if (lst->tombstones > 0 && lst->tombstones >= lst->capacity / 8) {
+			lst_compact(lst);
+		} else if (!lst_grow(lst)) {
+			if (lst->tombstones == 0) return -1;
+			lst_compact(lst);
+		}
+	}
+
+	/*
+	 * A segmented LST needs segments for the positions an insert may use:
+	 * the one past the last element, and, for bucket_add_front(), the one
+	 * before the first, or with bucket slack, up to bucket_slack more.
 	 */
-	if (unlikely(lst->num_elements == lst->capacity && !lst_expand(lst))) return -1;
+	if (unlikely(is_segmented(lst->layout)) &&
+	    (!segment_reserve(lst, lst->idx + lst->num_elements) || !segment_reserve(lst, lst->idx + lst->modulus - 1) ||
+	     (lst->bucket_slack > 0 &&
+	      (!segment_reserve(lst, lst->idx + lst->num_elements + lst->bucket_slack) ||
+	       !segment_reserve(lst, lst->idx + lst->modulus - 1 - lst->bucket_slack))))) return -1;
 
 	/*
 	 * Don't insert something that looks like it's already in an LST.
 	 */
-	data_index = item_index(lst, data);
-	if (unlikely(data_index > 0 ||
-	    (data_index == 0 && lst->num_elements > 0 && lst->idx == 0 && item(lst, 0) == data))) {
-		return -1;
+	if (is_indexed(lst->layout)) {
+		data_index = item_index(lst, data);
+		if (unlikely(data_index > 0 ||
+		    (data_index == 0 && offset_reduce(lst, lst->layout, -lst->idx) < lst->num_elements && item(lst, lst->layout, 0) == data))) {
+			return -1;
+		}
 	}
 
-	_lst_insert(lst, 0, data);
+	if (unlikely(stack_too_deep(lst))) stack_rebalance(lst);
+	LAYOUT_SPECIALIZE(lst,
+			  if (lst->key_project) {
+				  _lst_insert(lst, data, true, layout);
+			  } else {
+				  _lst_insert(lst, data, false, layout);
+			  });
 	return 1;
 }
 
 lst_index_t lst_num_elements(lst_t *lst)
 {
-	return lst->num_elements;
+	return lst->num_elements - lst->tombstones;
+}
+
+int lst_reserve(lst_t *lst, lst_index_t n)
+{
+	if (n <= lst->capacity) return 0;
+	return lst_expand(lst, n) ? 0 : -1;
+}
+
+void lst_shrink_to_fit(lst_t *lst)
+{
+	if (lst->tombstones > 0) lst_compact(lst);
+	lst_shrink(lst, lst->num_elements);
+
+	free(lst->scratch);
+	free(lst->oracle);
+	lst->scratch = NULL;
+	lst->oracle = NULL;
+	lst->scratch_size = 0;
+}
+
+size_t lst_memory_usage(lst_t *lst)
+{
+	size_t	slot_size = sizeof(void *) + (lst->key_project ? sizeof(uint64_t) : 0);
+	size_t	usage = sizeof(lst_t);
+
+	if (lst->segment) {
+		usage += lst->segments * (lst->key_segment ? sizeof(void **) + sizeof(uint64_t *) : sizeof(void **));
+		for (lst_index_t i = 0; i < lst->segments; i++) {
+			if (lst->segment[i]) usage += SEGMENT_SIZE * slot_size;
+		}
+	} else {
+		usage += lst->capacity * slot_size;
+	}
+
+	usage += lst->s.size * (sizeof(lst_index_t) + sizeof(uint8_t) + sizeof(uint64_t));
+	usage += lst->scratch_size * (sizeof(void *) + sizeof(uint8_t));
+	if (lst->tombstone) usage += tombstone_size(lst);
+
+	return usage;
+}
+
+void lst_stats(lst_t *lst, lst_stats_t *stats)
+{
+	stats->depth = stack_depth(&lst->s) - 1;
+	stats->rebalances = lst->rebalances;
 }
 
 void *lst_iter_init(lst_t *lst, lst_iter_t *iter)
 {
-	if (unlikely(!lst) || (lst->num_elements == 0)) return NULL;
+	if (unlikely(!lst) || (lst->num_elements == lst->tombstones)) return NULL;
 
 	*iter = lst->idx;
-	return item(lst, *iter);
+	if (is_tombstone(lst, lst->layout, *iter)) return lst_iter_next(lst, iter);
+	return item(lst, lst->layout, *iter);
 }
 
 void *lst_iter_next(lst_t *lst, lst_iter_t *iter)
 {
 	if (unlikely(!lst)) return NULL;
 
-	if ((*iter + 1) >= stack_item(&lst->s, 0)) return NULL;
-	*iter += 1;
+	do {
+		if ((*iter + 1) >= stack_item(&lst->s, 0)) return NULL;
+		*iter += 1;
+	} while (is_tombstone(lst, lst->layout, *iter));
 
-	return item(lst, *iter);
+	return item(lst, lst->layout, *iter);
 }
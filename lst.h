@@ -57,6 +57,115 @@ typedef lst_index_t	lst_iter_t;
  */
 typedef int8_t (*lst_cmp_t)(void const *a, void const *b);
 
+/** How partition() chooses its pivot
+ */
+typedef enum {
+	LST_PIVOT_RANDOM = 0,		//!< A single uniformly random element (the paper's choice).
+	LST_PIVOT_MEDIAN_OF_3,		//!< Median of three random elements.
+	LST_PIVOT_NINTHER,		//!< Median of three medians of three random elements.
+	LST_PIVOT_QUANTILE		//!< Element at pivot_quantile percent of a random sample,
+					///< to keep the leftmost bucket small for pop-heavy use.
+} lst_pivot_policy_t;
+
+/** How partition() rearranges a bucket around its pivot
+ */
+typedef enum {
+	LST_PARTITION_HOARE = 0,	//!< Hoare partition, one pivot per pass.
+	LST_PARTITION_THREE_WAY,	//!< Group all elements equal to the pivot and
+					///< record the run, so pops drain it without
+					///< comparisons.
+	LST_PARTITION_BLOCK		//!< BlockQuicksort-style branchless partition.
+} lst_partition_t;
+
+/** Type of a key stored at a fixed offset in each element
+ *
+ * An LST told where its elements keep their keys can partition buckets by
+ * loading the keys directly, using SIMD where the CPU supports it, instead
+ * of calling the comparator for each element. The comparator is still used
+ * elsewhere, and must order elements by ascending key; it may order elements
+ * whose keys are equal by anything else, and partitions ask it about those.
+ * Double keys must not be NaN.
+ */
+typedef enum {
+	LST_KEY_NONE = 0,		//!< No key; always use the comparator.
+	LST_KEY_INT32,
+	LST_KEY_INT64,
+	LST_KEY_DOUBLE
+} lst_key_type_t;
+
+/** Project an element onto a key the LST can cache
+ *
+ * An LST given a key projection keeps each element's key in an array
+ * alongside its element pointers, so that comparisons scan contiguous
+ * memory rather than following the pointers to elements that are likely
+ * cold in cache. Keys compare as unsigned integers, and must agree with
+ * the comparator: if cmp(a, b) < 0, then key(a) <= key(b). Elements whose
+ * keys are equal are ordered by the comparator, so a key may be coarser
+ * than the comparator, e.g. the whole seconds of a timestamp.
+ *
+ * Keys are projected once, on insert, so they must not change while the
+ * element is in the LST.
+ */
+typedef uint64_t (*lst_key_project_t)(void const *data);
+
+/** Options for lst_alloc_opts()
+ *
+ * A zeroed structure gives the same behaviour as lst_alloc().
+ */
+typedef struct {
+	bool		deterministic;	//!< Seed the LST's PRNG with seed rather than
+					///< a secret per-instance value from the OS, so
+					///< runs are reproducible (and pivots predictable).
+	uint64_t	seed;		//!< PRNG seed used when deterministic is true.
+	lst_pivot_policy_t pivot_policy; //!< How partition() picks pivots.
+	uint8_t		pivot_quantile;	//!< Percentile for LST_PIVOT_QUANTILE, 1-99;
+					///< 0 means the default.
+	lst_partition_t	partition;	//!< Partitioning scheme.
+	lst_key_type_t	key_type;	//!< Type of the key at key_offset, if any.
+	size_t		key_offset;	//!< offsetof() the key in the element structure.
+	uint8_t		multiway;	//!< If nonzero, split large buckets this many ways
+					///< (rounded down to a power of two, 4 to 64) in
+					///< one pass, pushing all the pivots at once.
+	int		sort_threshold;	//!< Sort, rather than partition, leftmost buckets of
+					///< at most this many elements, so later pops and
+					///< peeks need no comparisons. 0 means the default;
+					///< negative, never.
+	lst_key_project_t key_project;	//!< If set, cache each element's key next to it.
+					///< Partitions then use the cached keys rather
+					///< than key_type, and aren't multi-way.
+	bool		preserve_pivots; //!< When extracting a pivot, promote the largest
+					///< element to its left or the smallest to its
+					///< right in its place, rather than flattening
+					///< the subtree and losing the pivots below it.
+	double		lazy_delete;	//!< If nonzero, lst_extract() leaves a tombstone in
+					///< place of elements of unordered buckets rather
+					///< than closing the gap, and the LST compacts
+					///< once tombstones exceed this fraction (at most
+					///< 1) of the slots in use.
+	uint8_t		bucket_slack;	//!< If nonzero, an insert that has to move other
+					///< buckets to make room in one makes this many
+					///< slots more, so that the next inserts into the
+					///< bucket just fill them and move nothing.
+	bool		segmented;	//!< Keep elements in fixed-size segments reached
+					///< through a directory, so that growing allocates
+					///< segments rather than copying and re-indexing
+					///< the elements already there.
+	bool		shrink;		//!< Give memory back once fewer than an eighth
+					///< of the slots are in use, shrinking to twice
+					///< what the LST holds.
+	lst_index_t	initial_capacity; //!< Elements to make room for at first, and not
+					///< to shrink below; 0 means the default, 2048.
+	int		stack_capacity;	//!< Pivots to make room for at first; 0 means
+					///< the default, 32.
+	double		growth;		//!< Factor by which capacity grows when the LST
+					///< is full, e.g. 1.5 (at most 16; segmented LSTs
+					///< round it up to 2); 0 means the default, 2.
+	bool		prefetch;	//!< Prefetch elements a few moves or comparisons
+					///< ahead, which pays once the LST and its
+					///< elements outgrow the cache, but costs a few
+					///< percent while they fit.
+} lst_opts_t;
+
 /** Create an LST
  *
  * @param[in] _cmp		Comparator used to compare elements.
@@ -67,6 +176,34 @@ typedef int8_t (*lst_cmp_t)(void const *a, void const *b);
 
 lst_t *_lst_alloc(lst_cmp_t cmp, size_t offset) __attribute__((nonnull));
 
+/** Create an LST with non-default options
+ *
+ * @param[in] _cmp		Comparator used to compare elements.
+ * @param[in] _type		Of elements.
+ * @param[in] _field		to store LST indexes in.
+ * @param[in] _opts		Pointer to an lst_opts_t; may be NULL for defaults.
+ */
+#define lst_alloc_opts(_cmp, _type, _field, _opts) \
+	_lst_alloc_opts((_cmp), (size_t)(offsetof(_type, _field)), (_opts))
+
+lst_t *_lst_alloc_opts(lst_cmp_t cmp, size_t offset, lst_opts_t const *opts) __attribute__((nonnull(1)));
+
+/** Offset meaning elements have no field to store LST indexes in
+ */
+#define LST_NO_INDEX	SIZE_MAX
+
+/** Create an LST whose elements have no field to store LST indexes in
+ *
+ * Such an LST writes nothing to its elements, and reads them only through
+ * the comparator and key_project, which suits queues that only insert,
+ * peek and pop. It can't lst_extract() elements, though, and lst_insert()
+ * can't tell that an element is already in it.
+ *
+ * @param[in] _cmp		Comparator used to compare elements.
+ * @param[in] _opts		Pointer to an lst_opts_t; may be NULL for defaults.
+ */
+#define lst_alloc_unindexed(_cmp, _opts)	_lst_alloc_opts((_cmp), LST_NO_INDEX, (_opts))
+
 /** Free an LST
  *
  * @param[in] lst 		to be freed along with its underlying data
@@ -84,13 +221,60 @@ int 	lst_insert(lst_t *lst, void *data) __attribute__((nonnull));
  * @param[in] lst		the LST to remove an element from
  * @param[in] data		the element to remove
  * @return
- *	- 0 if removal succeeds
- * 	- -1 if removal fails
+ *	- 1 if removal succeeds
+ * 	- -1 if removal fails, as it always does for an LST without indexes
  */
 int	lst_extract(lst_t *lst, void *data) __attribute__((nonnull));
 
 lst_index_t	lst_num_elements(lst_t *lst) __attribute__((nonnull));
 
+/** Make room in an LST for at least n elements
+ *
+ * Growing once, to the capacity wanted, saves the repeated expansions,
+ * and their copying, of growing by inserts.
+ *
+ * @param[in] lst	to make room in.
+ * @param[in] n		number of elements to make room for.
+ * @return
+ *	- 0 if the LST has room for n elements.
+ *	- -1 if it can't be made that large.
+ */
+int		lst_reserve(lst_t *lst, lst_index_t n) __attribute__((nonnull));
+
+/** Shrink an LST's storage to the least that holds its elements
+ *
+ * It won't shrink below the initial capacity. Also frees the multi-way
+ * partition's scratch arrays, which are reallocated when next needed.
+ *
+ * @param[in] lst	to shrink.
+ */
+void		lst_shrink_to_fit(lst_t *lst) __attribute__((nonnull));
+
+/** Report how much heap memory an LST holds
+ *
+ * @param[in] lst	to report on.
+ * @return Bytes allocated for the LST, its element array or segments,
+ *	cached keys, pivot stack, and scratch arrays, not counting
+ *	allocator overhead or the elements themselves.
+ */
+size_t		lst_memory_usage(lst_t *lst) __attribute__((nonnull));
+
+/** Statistics reported by lst_stats()
+ */
+typedef struct {
+	int		depth;		//!< Pivots on the stack.
+	uint64_t	rebalances;	//!< Times inserts and extracts found the stack
+					///< too deep for the number of elements, and
+					///< thinned it to about log2 of that many pivots.
+} lst_stats_t;
+
+/** Report on the shape of an LST
+ *
+ * @param[in] lst	to report on.
+ * @param[out] stats	filled in with the LST's statistics.
+ */
+void		lst_stats(lst_t *lst, lst_stats_t *stats) __attribute__((nonnull));
+
 /** Iterate over entries in LST
  *
  * @param[in] lst	to iterate over.
@@ -0,0 +1,567 @@
+/** Benchmarks for a Leftmost Skeleton Tree
+ *
+ * @file lst_bench.c
+ *
+ * @copyright 2021 Network RADIUS SARL (legal@networkradius.com)
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * As with lst_tests.c, include the implementation so the benchmarks
+ * can see inside the opaque lst_t.
+ */
+#include "lst.c"
+
+typedef struct {
+	int		data;
+	lst_index_t	index;
+}	bench_thing;
+
+static int8_t	bench_cmp(void const *one, void const *two)
+{
+	bench_thing const	*item1 = one, *item2 = two;
+
+	return (item1->data > item2->data) - (item2->data > item1->data);
+}
+
+/*
+ * Keys are nonnegative, so they project onto themselves.
+ */
+static uint64_t bench_key_project(void const *data)
+{
+	return ((bench_thing const *)data)->data;
+}
+
+static int	key_range = 65537;
+static int	ascending_jitter;
+static bool	unindexed;
+
+/*
+ * Elements can be laid out further apart than a bench_thing needs, as
+ * larger structures would be, so that fewer of them share cache lines.
+ */
+static size_t	thing_size = sizeof(bench_thing);
+
+#define THING(_array, _i)	((bench_thing *)((uint8_t *)(_array) + (size_t)(_i) * thing_size))
+
+/*
+ * An LST that, unless told otherwise, keeps its indexes in bench_thing.
+ */
+static lst_t *bench_alloc(lst_opts_t const *opts)
+{
+	if (unindexed) return lst_alloc_unindexed(bench_cmp, opts);
+	return lst_alloc_opts(bench_cmp, bench_thing, index, opts);
+}
+
+/*
+ * How many times the LST has thinned its pivot stack, for the reports.
+ */
+static unsigned long long bench_rebalances(lst_t *lst)
+{
+	lst_stats_t	stats;
+
+	lst_stats(lst, &stats);
+	return stats.rebalances;
+}
+
+/*
+ * Keys are random unless asked for in ascending order, each off by less
+ * than the jitter, as timer schedules tend to be.
+ */
+static int bench_key(int i)
+{
+	if (ascending_jitter > 0) return i + rand() % ascending_jitter;
+	return rand() % key_range;
+}
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * The three sections of lst_cycle() from lst_tests.c, timed separately;
+ * see heap_vs_lst.md for what each of them exercises.
+ */
+static void bench_cycle(lst_opts_t const *opts, int size)
+{
+	lst_t		*lst;
+	bench_thing	*array;
+	int		to_remove;
+	double		start, insert_ms, first_pop_ms, extract_ms, swap_ms;
+
+	lst = bench_alloc(opts);
+	array = calloc(size, thing_size);
+	if (!lst || !array) {
+		fprintf(stderr, "bench_cycle(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < size; i++) THING(array, i)->data = bench_key(i);
+
+	start = now_ms();
+	for (int i = 0; i < size; i++) lst_insert(lst, THING(array, i));
+	insert_ms = now_ms() - start;
+
+	/*
+	 * The first pop after the inserts is timed separately too, since
+	 * it has to do the most partitioning.
+	 */
+	start = now_ms();
+	to_remove = size / 2;
+	lst_pop(lst);
+	first_pop_ms = now_ms() - start;
+	for (int i = 1; i < to_remove; i++) lst_pop(lst);
+	extract_ms = now_ms() - start;
+
+	/*
+	 * An LST without indexes can't extract, so skips this.
+	 */
+	start = now_ms();
+	for (int i = 0; !unindexed && i < size; i++) {
+		if (THING(array, i)->index == -1) {
+			lst_insert(lst, THING(array, i));
+		} else {
+			lst_extract(lst, THING(array, i));
+		}
+	}
+	swap_ms = now_ms() - start;
+
+	printf("cycle %d: insert %.2f ms, extract %.2f ms (first pop %.2f ms), swap %.2f ms, total %.2f ms, %llu rebalances\n",
+	       size, insert_ms, extract_ms, first_pop_ms, swap_ms, insert_ms + extract_ms + swap_ms, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+}
+
+/*
+ * lst_burn_in() from lst_tests.c: a random mix of inserts, pops and peeks.
+ */
+static void bench_burn_in(lst_opts_t const *opts, int ops)
+{
+	lst_t		*lst;
+	bench_thing	*array;
+	int		insert_count = 0;
+	double		start;
+
+	lst = bench_alloc(opts);
+	array = calloc(ops, thing_size);
+	if (!lst || !array) {
+		fprintf(stderr, "bench_burn_in(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < ops; i++) THING(array, i)->data = bench_key(i);
+
+	start = now_ms();
+	for (int i = 0; i < ops; i++) {
+		switch (lst_num_elements(lst) == 0 ? 0 : rand() % 3) {
+		case 0:
+			lst_insert(lst, THING(array, insert_count++));
+			break;
+		case 1:
+			lst_pop(lst);
+			break;
+		case 2:
+			lst_peek(lst);
+			break;
+		}
+	}
+	printf("burn_in %d: %.2f ms, %llu rebalances\n", ops, now_ms() - start, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+}
+
+/*
+ * The classic hold model: each operation pops the minimum and puts it back
+ * a little later, as a timer that rearms itself would. Those inserts land
+ * in the leftmost buckets, below most of the pivots.
+ */
+static void bench_hold(lst_opts_t const *opts, int size, int ops)
+{
+	lst_t		*lst;
+	bench_thing	*array, *thing;
+	double		start;
+
+	lst = bench_alloc(opts);
+	array = calloc(size, thing_size);
+	if (!lst || !array) {
+		fprintf(stderr, "bench_hold(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < size; i++) {
+		THING(array, i)->data = bench_key(i);
+		lst_insert(lst, THING(array, i));
+	}
+
+	start = now_ms();
+	for (int i = 0; i < ops; i++) {
+		thing = lst_pop(lst);
+		thing->data += 1 + rand() % 64;
+		lst_insert(lst, thing);
+	}
+	printf("hold %d: %d ops %.2f ms, %llu rebalances\n", size, ops, now_ms() - start, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+}
+
+/*
+ * Timers cancelled near the head of the queue: as hold, but each operation
+ * first cancels the pivot nearest the head, if there is one, and rearms
+ * it. That's the case preserve_pivots is for, since flattening there
+ * discards exactly the pivots the next pops want.
+ */
+static void bench_cancel(lst_opts_t const *opts, int size, int ops)
+{
+	lst_t		*lst;
+	bench_thing	*array, *thing;
+	double		start;
+
+	lst = bench_alloc(opts);
+	array = calloc(size, thing_size);
+	if (!lst || !array) {
+		fprintf(stderr, "bench_cancel(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < size; i++) {
+		THING(array, i)->data = bench_key(i);
+		lst_insert(lst, THING(array, i));
+	}
+
+	start = now_ms();
+	for (int i = 0; i < ops; i++) {
+		if (stack_depth(&lst->s) > 1) {
+			thing = pivot_item(lst, lst->layout, stack_depth(&lst->s) - 1);
+			lst_extract(lst, thing);
+			thing->data += 1 + rand() % 64;
+			lst_insert(lst, thing);
+		}
+		thing = lst_pop(lst);
+		thing->data += 1 + rand() % 64;
+		lst_insert(lst, thing);
+	}
+	printf("cancel %d: %d ops %.2f ms, %llu rebalances\n", size, ops, now_ms() - start, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+}
+
+/*
+ * Short-lived timers, like request timeouts that the reply nearly always
+ * cancels: each operation arms a timer due a little after the minimum and
+ * cancels the one armed SHORT_TIMERS operations before, so the cancels
+ * land in the leftmost buckets, to the left of most pivots; every fourth
+ * operation, the minimum also fires and is rearmed, as in hold.
+ */
+#define SHORT_TIMERS	256
+
+static void bench_short(lst_opts_t const *opts, int size, int ops)
+{
+	lst_t		*lst;
+	bench_thing	*array, *thing, *timers;
+	double		start;
+
+	lst = bench_alloc(opts);
+	array = calloc(size, thing_size);
+	timers = calloc(SHORT_TIMERS, sizeof(bench_thing));
+	if (!lst || !array || !timers) {
+		fprintf(stderr, "bench_short(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < size; i++) {
+		THING(array, i)->data = bench_key(i);
+		lst_insert(lst, THING(array, i));
+	}
+	for (int i = 0; i < SHORT_TIMERS; i++) timers[i].index = -1;
+
+	start = now_ms();
+	for (int i = 0; i < ops; i++) {
+		thing = &timers[i % SHORT_TIMERS];
+		if (thing->index >= 0) lst_extract(lst, thing);
+		thing->data = ((bench_thing *)lst_peek(lst))->data + 1 + rand() % 1024;
+		lst_insert(lst, thing);
+
+		if (i % 4 == 0) {
+			thing = lst_pop(lst);
+			thing->data += 1 + rand() % 64;
+			lst_insert(lst, thing);
+		}
+	}
+	printf("short %d: %d ops %.2f ms, %llu rebalances\n", size, ops, now_ms() - start, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+	free(timers);
+}
+
+/*
+ * Best-first search, as in Dijkstra's algorithm: each operation pops the
+ * minimum and inserts two successors a little after it, so the queue grows
+ * and inserts outnumber pops two to one, nearly all of them landing in the
+ * leftmost buckets.
+ */
+static void bench_grow(lst_opts_t const *opts, int size, int ops)
+{
+	lst_t		*lst;
+	bench_thing	*array, *thing;
+	double		start;
+
+	lst = bench_alloc(opts);
+	array = calloc(size + ops, thing_size);
+	if (!lst || !array) {
+		fprintf(stderr, "bench_grow(): allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < size; i++) {
+		THING(array, i)->data = bench_key(i);
+		lst_insert(lst, THING(array, i));
+	}
+
+	start = now_ms();
+	for (int i = 0; i < ops; i++) {
+		thing = lst_pop(lst);
+		THING(array, size + i)->data = thing->data + 1 + rand() % 64;
+		thing->data += 1 + rand() % 64;
+		lst_insert(lst, thing);
+		lst_insert(lst, THING(array, size + i));
+	}
+	printf("grow %d: %d ops %.2f ms, %llu rebalances\n", size, ops, now_ms() - start, bench_rebalances(lst));
+
+	lst_free(lst);
+	free(array);
+}
+
+static void usage(char const *name)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"  -n <size>      cycle size (default 1600000)\n"
+		"  -b <ops>       burn-in operations (default 0, i.e. skip)\n"
+		"  -l <ops>       hold operations on an LST of the cycle size (default 0, i.e. skip)\n"
+		"  -e <ops>       hold operations that also cancel the pivot nearest the head (default 0)\n"
+		"  -u <ops>       short-lived timer operations, most cancelled before they fire (default 0)\n"
+		"  -g <ops>       best-first search operations, each popping one and inserting two (default 0)\n"
+		"  -r <repeat>    number of runs (default 1)\n"
+		"  -m <range>     keys are drawn from [0, range) (default 65537)\n"
+		"  -a <jitter>    keys ascend instead, each off by less than jitter\n"
+		"  -s <seed>      seed data and LST PRNG for reproducible runs\n"
+		"  -p <policy>    pivot policy: random, median3, ninther, quantile\n"
+		"  -q <percent>   percentile for the quantile policy\n"
+		"  -k <kernel>    partition scheme: hoare, 3way, block\n"
+		"  -t <size>      sort leftmost buckets up to this size (-1: never)\n"
+		"  -w <ways>      split large buckets this many ways in one pass\n"
+		"  -x             give the LST the key's offset, so it can partition without the comparator\n"
+		"  -c             cache keys alongside the element pointers\n"
+		"  -f             on extracting a pivot, promote a neighbour rather than flatten\n"
+		"  -d <fraction>  delete lazily, compacting once this fraction of slots are tombstones\n"
+		"  -B <slots>     leave up to this many free slots (1-255) in a bucket an insert makes room in\n"
+		"  -S             keep elements in fixed-size segments, so growing never copies them\n"
+		"  -z             shrink as the LST drains\n"
+		"  -i <capacity>  initial capacity\n"
+		"  -G <factor>    growth factor, e.g. 1.5\n"
+		"  -N             give elements no index, skipping the cycle's swap stage; not with -e or -u\n"
+		"  -L <bytes>     lay elements out this far apart, e.g. 64 for one per cache line\n"
+		"  -P             prefetch elements ahead of moving or comparing them\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	lst_opts_t	opts = { 0 };
+	int		size = 1600000, burn_in_ops = 0, hold_ops = 0, cancel_ops = 0, short_ops = 0, grow_ops = 0, repeat = 1;
+	int		c;
+
+	srand((unsigned int)time(NULL));
+
+	while ((c = getopt(argc, argv, "n:b:l:e:u:g:r:m:a:s:p:q:k:t:w:xcfd:B:Szi:G:NL:Ph")) != -1) switch (c) {
+	case 'n':
+		size = atoi(optarg);
+		break;
+
+	case 'b':
+		burn_in_ops = atoi(optarg);
+		break;
+
+	case 'l':
+		hold_ops = atoi(optarg);
+		break;
+
+	case 'e':
+		cancel_ops = atoi(optarg);
+		break;
+
+	case 'u':
+		short_ops = atoi(optarg);
+		break;
+
+	case 'g':
+		grow_ops = atoi(optarg);
+		break;
+
+	case 'r':
+		repeat = atoi(optarg);
+		break;
+
+	case 'm':
+		key_range = atoi(optarg);
+		if (key_range <= 0) usage(argv[0]);
+		break;
+
+	case 'a':
+		ascending_jitter = atoi(optarg);
+		if (ascending_jitter <= 0) usage(argv[0]);
+		break;
+
+	case 's':
+		opts.deterministic = true;
+		opts.seed = strtoull(optarg, NULL, 0);
+		srand((unsigned int)opts.seed);
+		break;
+
+	case 'p':
+		if (strcmp(optarg, "random") == 0) {
+			opts.pivot_policy = LST_PIVOT_RANDOM;
+		} else if (strcmp(optarg, "median3") == 0) {
+			opts.pivot_policy = LST_PIVOT_MEDIAN_OF_3;
+		} else if (strcmp(optarg, "ninther") == 0) {
+			opts.pivot_policy = LST_PIVOT_NINTHER;
+		} else if (strcmp(optarg, "quantile") == 0) {
+			opts.pivot_policy = LST_PIVOT_QUANTILE;
+		} else {
+			usage(argv[0]);
+		}
+		break;
+
+	case 'q':
+		opts.pivot_quantile = atoi(optarg);
+		break;
+
+	case 'k':
+		if (strcmp(optarg, "hoare") == 0) {
+			opts.partition = LST_PARTITION_HOARE;
+		} else if (strcmp(optarg, "3way") == 0) {
+			opts.partition = LST_PARTITION_THREE_WAY;
+		} else if (strcmp(optarg, "block") == 0) {
+			opts.partition = LST_PARTITION_BLOCK;
+		} else {
+			usage(argv[0]);
+		}
+		break;
+
+	case 't':
+		opts.sort_threshold = atoi(optarg);
+		break;
+
+	case 'w':
+		opts.multiway = atoi(optarg);
+		break;
+
+	case 'x':
+		opts.key_type = LST_KEY_INT32;
+		opts.key_offset = offsetof(bench_thing, data);
+		break;
+
+	case 'c':
+		opts.key_project = bench_key_project;
+		break;
+
+	case 'f':
+		opts.preserve_pivots = true;
+		break;
+
+	case 'd':
+		opts.lazy_delete = atof(optarg);
+		if (opts.lazy_delete <= 0) usage(argv[0]);
+		break;
+
+	case 'B':
+		if (atoi(optarg) <= 0 || atoi(optarg) > 255) usage(argv[0]);
+		opts.bucket_slack = atoi(optarg);
+		break;
+
+	case 'S':
+		opts.segmented = true;
+		break;
+
+	case 'z':
+		opts.shrink = true;
+		break;
+
+	case 'i':
+		opts.initial_capacity = atoi(optarg);
+		if (opts.initial_capacity <= 0) usage(argv[0]);
+		break;
+
+	case 'G':
+		opts.growth = atof(optarg);
+		if (opts.growth <= 1) usage(argv[0]);
+		break;
+
+	case 'N':
+		unindexed = true;
+		break;
+
+	case 'L':
+		if (atoi(optarg) < (int)sizeof(bench_thing) || atoi(optarg) % _Alignof(bench_thing)) usage(argv[0]);
+		thing_size = atoi(optarg);
+		break;
+
+	case 'P':
+		opts.prefetch = true;
+		break;
+
+	default:
+		usage(argv[0]);
+	}
+	if (unindexed && (cancel_ops > 0 || short_ops > 0)) usage(argv[0]);
+
+	for (int i = 0; i < repeat; i++) {
+		if (size > 0) bench_cycle(&opts, size);
+		if (burn_in_ops > 0) bench_burn_in(&opts, burn_in_ops);
+		if (hold_ops > 0 && size > 0) bench_hold(&opts, size, hold_ops);
+		if (cancel_ops > 0 && size > 0) bench_cancel(&opts, size, cancel_ops);
+		if (short_ops > 0 && size > 0) bench_short(&opts, size, short_ops);
+		if (grow_ops > 0 && size > 0) bench_grow(&opts, size, grow_ops);
+	}
+
+	return EXIT_SUCCESS;
+}
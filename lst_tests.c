@@ -31,10 +31,17 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+/*
+ * Have LSTs with keys use them for all but tiny buckets, so the keyed
+ * kernels see plenty of partitions, including ones that wrap around.
+ */
+#define KEYED_PARTITION_MIN	16
+
 /*
  * This counterintuitive #include gives these separately-compiled
  * tests access to elements of the opaque lst_t structure which are
@@ -45,18 +52,16 @@
 typedef struct {
         int		data;
 	lst_index_t	index;
-	bool		visited;	/* Only used by iterator test */
+	bool		visited;	/* Used by iterator and deep insert tests */
 }       heap_thing;
 
-#if 0
 static bool	lst_validate(lst_t *lst, bool show_items);
-#endif
 
 static bool lst_contains(lst_t *lst, void *data)
 {
 	int size = lst_num_elements(lst);
 
-	for (int i = 0; i < size; i++) if (item(lst, i + lst->idx) == data) return true;
+	for (int i = 0; i < size; i++) if (item(lst, lst->layout, i + lst->idx) == data) return true;
 
 	return false;
 }
@@ -130,7 +135,7 @@ static void lst_test(int skip)
 		return;
 	}
 
-	array = malloc(sizeof(heap_thing) * LST_TEST_SIZE);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
 	if (array == NULL) {
 		lst_free(lst);
 		fprintf(stderr, "lst_test(%d): failed to create array\n", skip);
@@ -405,175 +410,2068 @@ static void lst_cycle(void)
 	free(array);
 }
 
-static void lst_iter(void)
+/*
+ * Two LSTs seeded identically and fed the same operations must make the
+ * same pivot and flatten choices, and hence end up laid out identically.
+ */
+static void lst_test_deterministic(void)
 {
-	lst_t	*lst;
-	lst_iter_t	iter;
-	heap_thing	values[NVALUES], *data;
+	lst_opts_t	opts = { .deterministic = true, .seed = 42 };
+	lst_t		*lst1, *lst2;
+	heap_thing	*array1, *array2;
+
+	lst1 = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	lst2 = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	array1 = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	array2 = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst1 || !lst2 || !array1 || !array2) {
+		fprintf(stderr, "lst_test_deterministic(): allocation failed\n");
+		goto done;
+	}
 
-	lst = lst_alloc(heap_cmp, heap_thing, index);
+	for (int i = 0; i < LST_TEST_SIZE; i++) array1[i].data = array2[i].data = rand() % 65537;
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		lst_insert(lst1, &array1[i]);
+		lst_insert(lst2, &array2[i]);
+		if (i % 3 == 0) {
+			lst_pop(lst1);
+			lst_pop(lst2);
+		}
+	}
+
+	if (stack_depth(&lst1->s) != stack_depth(&lst2->s)) {
+		fprintf(stderr, "lst_test_deterministic(): pivot stacks differ in depth\n");
+	}
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		if (array1[i].index != array2[i].index) {
+			fprintf(stderr, "lst_test_deterministic(): element %d placed differently\n", i);
+			break;
+		}
+	}
+
+done:
+	if (lst1) lst_free(lst1);
+	if (lst2) lst_free(lst2);
+	free(array1);
+	free(array2);
+}
+
+/*
+ * Insert random values in [0, key_range) into an LST created with the given
+ * options, with some pops along the way, then check that pops yield them in order.
+ */
+static void lst_test_pop_order(char const *name, lst_opts_t const *opts, int key_range)
+{
+	lst_t		*lst;
+	heap_thing	*array, *prev = NULL;
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
 	if (lst == NULL) {
-		fprintf(stderr, "lst_iter(): failed to create lst\n");
+		fprintf(stderr, "%s: failed to create LST\n", name);
 		return;
 	}
 
-	for (int i = 0; i < NVALUES; i++) {
-		values[i].data = i;
-		values[i].index = 0;
-		values[i].visited = false;
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (array == NULL) {
+		lst_free(lst);
+		fprintf(stderr, "%s: failed to create array\n", name);
+		return;
 	}
 
-	for (int i = 0; i < NVALUES - 1; i++) {
-		int	j = rand() % (NVALUES - i);
-		int	temp = values[i].data;
+	for (int i = 0; i < LST_TEST_SIZE; i++) array[i].data = rand() % key_range;
 
-		values[i].data = values[j].data;
-		values[j].data = temp;
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		if (lst_insert(lst, &array[i]) < 0) {
+			fprintf(stderr, "%s: element %d insert failed\n", name, i);
+		}
+		if (i % 4 == 3 && lst_pop(lst) == NULL) {
+			fprintf(stderr, "%s: pop failed during inserts, iteration %d\n", name, i);
+		}
+		if (i % 256 == 255 && !lst_validate(lst, false)) {
+			fprintf(stderr, "%s: LST invalid after %d inserts\n", name, i + 1);
+		}
 	}
 
-	for (int i = 0; i < NVALUES; i++) {
-		if (lst_insert(lst, &values[i]) < 0) {
-			fprintf(stderr, "lst_iter(): insert #%d failed\n", i + 1);
+	for (int i = 0; i < LST_TEST_SIZE; i += 7) lst_extract(lst, &array[i]);
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after extracts\n", name);
+
+	for (int i = lst_num_elements(lst); i > 0; i--) {
+		heap_thing	*value = lst_pop(lst);
+
+		if (value == NULL) {
+			fprintf(stderr, "%s: pop failed; expected %d elements remaining\n", name, i);
+			break;
+		}
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
 		}
+		prev = value;
 	}
 
-	data = lst_iter_init(lst, &iter);
+	lst_free(lst);
+	free(array);
+}
 
-	for (int i = 0; i < NVALUES; i++, data = lst_iter_next(lst, &iter)) {
-		if (data == NULL) {
-			fprintf(stderr, "lst_iter(): unexpected end at %d\n", i);
-		} else {
-			if (data->visited) {
-				fprintf(stderr, "lst_iter(): visited element more than once\n");
-			}
-			if (data->index < 0) {
-				fprintf(stderr, "lst_iter(): visited element not in LST\n");
+static void lst_test_pivot_policies(void)
+{
+	lst_opts_t	opts = { 0 };
+
+	opts.pivot_policy = LST_PIVOT_MEDIAN_OF_3;
+	lst_test_pop_order("lst_test_pivot_policies(median of 3)", &opts, 65537);
+
+	opts.pivot_policy = LST_PIVOT_NINTHER;
+	lst_test_pop_order("lst_test_pivot_policies(ninther)", &opts, 65537);
+
+	opts.pivot_policy = LST_PIVOT_QUANTILE;
+	lst_test_pop_order("lst_test_pivot_policies(quantile)", &opts, 65537);
+
+	opts.pivot_quantile = 5;
+	lst_test_pop_order("lst_test_pivot_policies(quantile 5%)", &opts, 65537);
+}
+
+static int	cmp_calls;
+
+static int8_t	heap_cmp_counted(void const *one, void const *two)
+{
+	cmp_calls++;
+	return heap_cmp(one, two);
+}
+
+/*
+ * Only counts comparisons with elements marked visited.
+ */
+static int8_t	heap_cmp_marked(void const *one, void const *two)
+{
+	if (((heap_thing const *)one)->visited) cmp_calls++;
+	return heap_cmp(one, two);
+}
+
+/*
+ * With heavily duplicated keys, a three-way partition turns the run of
+ * elements equal to the pivot into pivots, so once the first of the run
+ * is popped, the rest come out without any comparisons.
+ */
+static void lst_test_three_way(void)
+{
+	lst_opts_t	opts = { .partition = LST_PARTITION_THREE_WAY };
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		run = 0;
+
+	lst_test_pop_order("lst_test_three_way()", &opts, 65537);
+	lst_test_pop_order("lst_test_three_way(duplicates)", &opts, 8);
+
+	lst = lst_alloc_opts(heap_cmp_counted, heap_thing, index, &opts);
+	if (lst == NULL) {
+		fprintf(stderr, "lst_test_three_way(): failed to create LST\n");
+		return;
+	}
+
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (array == NULL) {
+		lst_free(lst);
+		fprintf(stderr, "lst_test_three_way(): failed to create array\n");
+		return;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].data = rand() % 8;
+		lst_insert(lst, &array[i]);
+	}
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_three_way(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		if (prev && prev->data == value->data) {
+			if (cmp_calls != 0) {
+				fprintf(stderr, "lst_test_three_way(): pop within a run of %d made %d comparisons\n",
+					value->data, cmp_calls);
 			}
-			data->visited = true;
+			run++;
 		}
+		prev = value;
+		cmp_calls = 0;
 	}
 
-	if (data != NULL) {
-		fprintf(stderr, "lst_iter(): iterator didn't terminate as expected\n");
+	if (run < LST_TEST_SIZE - 8) {
+		fprintf(stderr, "lst_test_three_way(): only %d pops came from runs\n", run);
 	}
+
 	lst_free(lst);
+	free(array);
 }
 
-#if 0
-static bool lst_validate(lst_t *lst, bool show_items)
+static void lst_test_block_partition(void)
 {
-	lst_index_t	fake_pivot_index, reduced_fake_pivot_index, reduced_end;
-	int		depth = stack_depth(lst->s);
-	int		bucket_size_sum;
-	bool		pivots_in_order = true;
-	bool		pivot_indices_in_order = true;
-	bool		is_valid = true;
+	lst_opts_t	opts = { .partition = LST_PARTITION_BLOCK };
 
-	/*
-	 * There has to be at least the fictitious pivot.
-	 */
-	if (depth < 1) {
-		fprintf(stderr, "lst_validate(): LST pivot stack empty\n");
-		return false;
-	}
+	lst_test_pop_order("lst_test_block_partition()", &opts, 65537);
+	lst_test_pop_order("lst_test_block_partition(duplicates)", &opts, 8);
+}
 
-	/*
-	 * Modulo circularity, idx + the number of elements should be the index
-	 * of the fictitious pivot.
-	 */
-	fake_pivot_index = stack_item(lst->s, 0);
-	reduced_fake_pivot_index = index_reduce(lst, fake_pivot_index);
-	reduced_end = index_reduce(lst, lst->idx + lst->num_elements);
-	if (reduced_fake_pivot_index != reduced_end) {
-		fprintf(stderr, "lst_validate(): fictitious pivot inconsistent with idx and number of elements");
-		is_valid = false;
+typedef struct {
+	int32_t		i32;
+	int64_t		i64;
+	double		d;
+	lst_index_t	index;
+}	keyed_thing;
+
+static int8_t	keyed_cmp_i32(void const *one, void const *two)
+{
+	keyed_thing const	*item1 = one, *item2 = two;
+
+	return (item1->i32 > item2->i32) - (item2->i32 > item1->i32);
+}
+
+static int8_t	keyed_cmp_i64(void const *one, void const *two)
+{
+	keyed_thing const	*item1 = one, *item2 = two;
+
+	return (item1->i64 > item2->i64) - (item2->i64 > item1->i64);
+}
+
+static int8_t	keyed_cmp_d(void const *one, void const *two)
+{
+	keyed_thing const	*item1 = one, *item2 = two;
+
+	return (item1->d > item2->d) - (item2->d > item1->d);
+}
+
+/*
+ * Orders by the int32 key, breaking ties by the int64 field, as timers
+ * with the same expiry might be ordered by when they were armed.
+ */
+static int8_t	keyed_cmp_i32_ties(void const *one, void const *two)
+{
+	keyed_thing const	*item1 = one, *item2 = two;
+
+	if (item1->i32 != item2->i32) return (item1->i32 > item2->i32) - (item2->i32 > item1->i32);
+	return (item1->i64 > item2->i64) - (item2->i64 > item1->i64);
+}
+
+/*
+ * Exercise the keyed partition with the given kernel on all key types,
+ * with keys both mostly distinct and heavily duplicated. Pops and extracts
+ * are mixed in so that buckets wrap around the circular array.
+ */
+static void lst_test_keyed_kernel(char const *name, lst_classify_t classify)
+{
+	static struct {
+		lst_key_type_t	type;
+		size_t		offset;
+		lst_cmp_t	cmp;
+	} const		keys[] = {
+		{ LST_KEY_INT32, offsetof(keyed_thing, i32), keyed_cmp_i32 },
+		{ LST_KEY_INT64, offsetof(keyed_thing, i64), keyed_cmp_i64 },
+		{ LST_KEY_DOUBLE, offsetof(keyed_thing, d), keyed_cmp_d }
+	};
+	keyed_thing	*array;
+
+	array = calloc(LST_TEST_SIZE, sizeof(keyed_thing));
+	if (array == NULL) {
+		fprintf(stderr, "%s: failed to create array\n", name);
+		return;
 	}
 
-	/*
-	 * Bucket sizes must make sense.
-	 */
-	if (lst->num_elements) {
-		bucket_size_sum = 0;
+	for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+		for (int range = 65537; range >= 8; range /= 8192) {
+			lst_opts_t	opts = { .key_type = keys[k].type, .key_offset = keys[k].offset };
+			lst_t		*lst = _lst_alloc_opts(keys[k].cmp, offsetof(keyed_thing, index), &opts);
+			keyed_thing	*value, *prev = NULL;
 
-		for (int stack_index = 0; stack_index < depth; stack_index++)  {
-			lst_index_t bucket_size = bucket_upb(lst, stack_index) - bucket_lwb(lst, stack_index) + 1;
-			if (bucket_size > lst->num_elements) {
-				fprintf(stderr, "bucket %d size %d is invalid\n", stack_index, bucket_size);
-				is_valid = false;
+			if (lst == NULL) {
+				fprintf(stderr, "%s: failed to create LST\n", name);
+				continue;
 			}
-			bucket_size_sum += bucket_size;
-		}
+			lst->classify = classify;
 
-		if (bucket_size_sum + depth - 1 != lst->num_elements) {
-			fprintf(stderr, "total bucket size inconsistent with number of elements\n");
-			is_valid = false;
+			for (int i = 0; i < LST_TEST_SIZE; i++) {
+				int	r = rand() % range;
+
+				array[i].i32 = r - range / 2;
+				array[i].i64 = ((int64_t)r << 32) - ((int64_t)range << 31);
+				array[i].d = r / 3.0 - range;
+				array[i].index = 0;
+				lst_insert(lst, &array[i]);
+				if (i % 3 == 0) lst_pop(lst);
+			}
+			for (int i = 0; i < LST_TEST_SIZE; i += 5) lst_extract(lst, &array[i]);
+
+			if (!lst_validate(lst, false)) fprintf(stderr, "%s: key type %d: LST invalid\n", name, keys[k].type);
+
+			while ((value = lst_pop(lst)) != NULL) {
+				if (prev && keys[k].cmp(prev, value) > 0) {
+					fprintf(stderr, "%s: key type %d: pops out of order\n", name, keys[k].type);
+					break;
+				}
+				prev = value;
+			}
+			lst_free(lst);
 		}
 	}
 
-	/*d
-	 * No elements should be NULL.
-	 */
-	for (lst_index_t i = 0; i < lst->num_elements; i++) {
-		if (!item(lst, lst->idx + i)) {
-			fprintf(stderr, "null element at %d\n", lst->idx + i);
-			is_valid = false;
+	free(array);
+}
+
+/*
+ * The comparator may order elements whose keys are equal, so the keyed
+ * partitions must ask it about those rather than treat them as equal.
+ */
+static void lst_test_keyed_ties(char const *name, lst_classify_t classify, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	keyed_thing	*array, *value, *prev = NULL;
+	int		count = 0;
+
+	array = calloc(LST_TEST_SIZE, sizeof(keyed_thing));
+	lst = _lst_alloc_opts(keyed_cmp_i32_ties, offsetof(keyed_thing, index), opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+	lst->classify = classify;
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].i32 = rand() % 16;
+		array[i].i64 = rand();
+		lst_insert(lst, &array[i]);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid\n", name);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && keyed_cmp_i32_ties(prev, value) > 0) {
+			fprintf(stderr, "%s: pops out of order\n", name);
+			break;
+		}
+		prev = value;
+		count++;
+		if (count % 64 == 0 && !lst_validate(lst, false)) {
+			fprintf(stderr, "%s: LST invalid after %d pops\n", name, count);
+			break;
 		}
 	}
 
-	/*
-	 * There's nothing more to check for a one-bucket tree.
-	 */
-	if (is_bucket(lst, 0)) return is_valid;
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
 
-	/*
-	 * Otherwise, first, pivots from left to right (aside from the fictitious
-	 * one) should be in ascending order.
-	 */
-	for (int stack_index = 1; stack_index + 1 < depth; stack_index++) {
-		heap_thing	*current_pivot = pivot_item(lst, stack_index);
-		heap_thing	*next_pivot = pivot_item(lst, stack_index + 1);
+static void lst_test_keyed(void)
+{
+	lst_opts_t	opts = { .key_type = LST_KEY_INT32, .key_offset = offsetof(keyed_thing, i32) };
+
+	lst_test_keyed_kernel("lst_test_keyed(scalar)", classify_scalar);
+	lst_test_keyed_ties("lst_test_keyed(scalar, ties)", classify_scalar, &opts);
+#ifdef LST_HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		lst_test_keyed_kernel("lst_test_keyed(avx2)", classify_avx2);
+		lst_test_keyed_ties("lst_test_keyed(avx2, ties)", classify_avx2, &opts);
+	}
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+		lst_test_keyed_kernel("lst_test_keyed(avx512)", classify_avx512);
+		lst_test_keyed_ties("lst_test_keyed(avx512, ties)", classify_avx512, &opts);
+	}
+#endif
+}
 
-		if (current_pivot && next_pivot && lst->cmp(current_pivot, next_pivot) < 0) pivots_in_order = false;
+/*
+ * A multi-way partition of a large bucket should push all its pivots
+ * in one go, and leave an LST that pops in order.
+ */
+static void lst_test_multiway(void)
+{
+	lst_opts_t	opts = { .multiway = 16 };
+	lst_opts_t	keyed = { .key_type = LST_KEY_INT32, .key_offset = offsetof(keyed_thing, i32), .multiway = 16 };
+	lst_t		*lst;
+	heap_thing	*array;
+
+	lst_test_pop_order("lst_test_multiway()", &opts, 65537);
+	lst_test_pop_order("lst_test_multiway(duplicates)", &opts, 8);
+	opts.multiway = 64;
+	lst_test_pop_order("lst_test_multiway(64 ways)", &opts, 65537);
+	lst_test_keyed_ties("lst_test_multiway(keyed, ties)", classify_select(), &keyed);
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "lst_test_multiway(): allocation failed\n");
+		goto done;
 	}
-	if (!pivots_in_order) {
-		fprintf(stderr, "pivots not in ascending order\n");
-		is_valid = false;
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].data = rand() % 65537;
+		lst_insert(lst, &array[i]);
 	}
 
-	/*
-	 * Next, all non-fictitious pivots must correspond to non-null elements of the array.
-	 */
-	for (int stack_index = 1; stack_index < depth; stack_index++) {
-		if (!pivot_item(lst, stack_index)) {
-			fprintf(stderr, "pivot #%d refers to NULL", stack_index);
-			is_valid = false;
-		}
+	lst_peek(lst);
+	if (stack_depth(&lst->s) < 64) {
+		fprintf(stderr, "lst_test_multiway(): first peek left only %zu pivots\n", stack_depth(&lst->s) - 1);
 	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_multiway(): LST invalid after first peek\n");
 
-	/*
-	 * Next, the stacked pivot indices should decrease as you ascend from
-	 * the bottom of the pivot stack. Here we *do* include the fictitious
-	 * pivot; we're just comparing indices.
-	 */
-	for (int stack_index = 0; stack_index + 1 < depth; stack_index++) {
-		lst_index_t current_pivot_index = stack_item(lst->s, stack_index);
-		lst_index_t previous_pivot_index = stack_item(lst->s, stack_index + 1);
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
 
+/*
+ * Once the leftmost bucket is small enough to be sorted, pops and peeks
+ * shouldn't need the comparator until something is inserted into it.
+ */
+static void lst_test_sorted_run(void)
+{
+	lst_opts_t	opts = { .sort_threshold = 64 };
+	lst_t		*lst;
+	heap_thing	values[NVALUES], extra = { .data = -1 };
+	heap_thing	*value;
 
-		if (previous_pivot_index >= current_pivot_index) pivot_indices_in_order = false;
+	opts.sort_threshold = -1;
+	lst_test_pop_order("lst_test_sorted_run(never)", &opts, 65537);
+	opts.sort_threshold = 64;
+	lst_test_pop_order("lst_test_sorted_run()", &opts, 65537);
+
+	lst = lst_alloc_opts(heap_cmp_counted, heap_thing, index, &opts);
+	if (lst == NULL) {
+		fprintf(stderr, "lst_test_sorted_run(): failed to create LST\n");
+		return;
 	}
 
-	if (!pivot_indices_in_order) {
-		fprintf(stderr, "pivot indices not in order\n");
-		is_valid = false;
+	for (int i = 0; i < NVALUES; i++) {
+		values[i].data = rand() % 65537;
+		values[i].index = 0;
+		lst_insert(lst, &values[i]);
+	}
+
+	lst_peek(lst);
+	cmp_calls = 0;
+	for (int i = 0; i < NVALUES / 2; i++) {
+		lst_peek(lst);
+		lst_pop(lst);
+	}
+	if (cmp_calls != 0) {
+		fprintf(stderr, "lst_test_sorted_run(): pops from sorted run made %d comparisons\n", cmp_calls);
 	}
 
 	/*
-	 * Finally...
-	 * values in buckets shouldn't "follow" the pivot to the immediate right (if it exists)
-	 * and shouldn't "precede" the pivot to the immediate left (if it exists)
-	 *
-	 * todo: this will find pivot ordering issues as well; get rid of that ultimately,
+	 * Something smaller than everything lands in the run, and must come out first.
+	 */
+	lst_insert(lst, &extra);
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_sorted_run(): LST invalid after insert\n");
+	if (lst_pop(lst) != &extra) fprintf(stderr, "lst_test_sorted_run(): insert into run lost order\n");
+
+	for (int i = NVALUES / 2; i < NVALUES; i++) {
+		value = lst_pop(lst);
+		if (value == NULL) fprintf(stderr, "lst_test_sorted_run(): pop failed\n");
+	}
+
+	lst_free(lst);
+}
+
+/*
+ * Timers: each insert is the time of the last pop plus a fixed timeout
+ * and a little jitter, so inserts arrive in nearly ascending order. Check that the LST keeps
+ * them in order and costs a handful of comparisons an operation rather
+ * than repeatedly partitioning.
+ */
+static void lst_test_presorted_run(char const *name, int jitter)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value;
+	int		now = 0, next = 0;
+	long		ops = 0, calls = 0;
+
+	lst = lst_alloc(heap_cmp_counted, heap_thing, index);
+	if (lst == NULL) {
+		fprintf(stderr, "%s: failed to create LST\n", name);
+		return;
+	}
+
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (array == NULL) {
+		lst_free(lst);
+		fprintf(stderr, "%s: failed to create array\n", name);
+		return;
+	}
+
+	cmp_calls = 0;
+	while (next < LST_TEST_SIZE / 4) {
+		array[next].data = next + rand() % jitter;
+		lst_insert(lst, &array[next++]);
+		ops++;
+	}
+
+	while ((value = lst_pop(lst)) != NULL) {
+		ops++;
+		if (value->data < now) fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, now);
+		now = value->data;
+		if (next < LST_TEST_SIZE) {
+			array[next].data = now + LST_TEST_SIZE / 4 + rand() % jitter;
+			lst_insert(lst, &array[next++]);
+			ops++;
+		}
+	}
+	calls = cmp_calls;
+
+	if (next != LST_TEST_SIZE || lst_num_elements(lst) != 0) fprintf(stderr, "%s: lost elements\n", name);
+	if (calls > 2 * ops) {
+		fprintf(stderr, "%s: %ld operations made %ld comparisons\n", name, ops, calls);
+	}
+
+	lst_free(lst);
+	free(array);
+}
+
+static void lst_test_presorted(void)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		count = 0;
+
+	lst_test_presorted_run("lst_test_presorted(ascending)", 1);
+	lst_test_presorted_run("lst_test_presorted(jitter)", SORTED_INSERT_MAX / 2);
+
+	/*
+	 * A sorted leftmost bucket that gets inserts from all over must split
+	 * rather than give wrong answers.
+	 */
+	lst = lst_alloc(heap_cmp, heap_thing, index);
+	if (lst == NULL) {
+		fprintf(stderr, "lst_test_presorted(): failed to create LST\n");
+		return;
+	}
+
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (array == NULL) {
+		lst_free(lst);
+		fprintf(stderr, "lst_test_presorted(): failed to create array\n");
+		return;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].data = (i < LST_TEST_SIZE / 2) ? i * 2 : rand() % LST_TEST_SIZE;
+		lst_insert(lst, &array[i]);
+		if (i % 64 == 0 && !lst_validate(lst, false)) {
+			fprintf(stderr, "lst_test_presorted(): LST invalid after insert #%d\n", i + 1);
+		}
+	}
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_presorted(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != LST_TEST_SIZE) fprintf(stderr, "lst_test_presorted(): popped %d of %d\n", count, LST_TEST_SIZE);
+
+	lst_free(lst);
+	free(array);
+}
+
+static uint64_t heap_key(void const *data)
+{
+	return ((heap_thing const *)data)->data;
+}
+
+/*
+ * Only good to within 16, so the comparator has to settle ties.
+ */
+static uint64_t heap_key_coarse(void const *data)
+{
+	return ((heap_thing const *)data)->data >> 4;
+}
+
+/*
+ * With cached keys, the LST must keep each key with its element through
+ * every kind of partition, and with an exact key it should never need the
+ * comparator for distinct elements.
+ */
+static void lst_test_key_cache(void)
+{
+	lst_opts_t	opts = { .key_project = heap_key };
+	lst_partition_t	const partitions[] = { LST_PARTITION_HOARE, LST_PARTITION_THREE_WAY, LST_PARTITION_BLOCK };
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		calls;
+
+	for (size_t i = 0; i < sizeof(partitions) / sizeof(partitions[0]); i++) {
+		opts.partition = partitions[i];
+		opts.key_project = heap_key;
+		lst_test_pop_order("lst_test_key_cache()", &opts, 65537);
+		lst_test_pop_order("lst_test_key_cache(duplicates)", &opts, 8);
+		opts.key_project = heap_key_coarse;
+		lst_test_pop_order("lst_test_key_cache(coarse)", &opts, 65537);
+	}
+
+	opts.partition = LST_PARTITION_HOARE;
+	opts.key_project = heap_key;
+	lst = lst_alloc_opts(heap_cmp_counted, heap_thing, index, &opts);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "lst_test_key_cache(): allocation failed\n");
+		goto done;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) array[i].data = i;
+	for (int i = 0; i < LST_TEST_SIZE - 1; i++) {
+		int	j = i + rand() % (LST_TEST_SIZE - i);
+		int	temp = array[i].data;
+
+		array[i].data = array[j].data;
+		array[j].data = temp;
+	}
+
+	cmp_calls = 0;
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		lst_insert(lst, &array[i]);
+		if (i % 4 == 3) lst_pop(lst);
+	}
+	for (int i = 0; i < LST_TEST_SIZE; i += 7) lst_extract(lst, &array[i]);
+	calls = cmp_calls;
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_key_cache(): LST invalid\n");
+	cmp_calls = 0;
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_key_cache(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+	}
+	calls += cmp_calls;
+	if (calls != 0) fprintf(stderr, "lst_test_key_cache(): exact keys made %d comparisons\n", calls);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+/*
+ * Extracting pivots with preserve_pivots set should keep the pivots below
+ * them, and keep the LST valid, whatever order its buckets are in.
+ */
+static void lst_test_preserve_pivots_run(char const *name, lst_opts_t const *opts, int key_range)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		count = 0, extracted = 0;
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].data = rand() % key_range;
+		lst_insert(lst, &array[i]);
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE / 4; i++) {
+		int		depth = stack_depth(&lst->s);
+		stack_index_t	k;
+		bool		left_empty;
+
+		/*
+		 * Pop now and then to build the stack back up.
+		 */
+		if (depth == 1 || i % 8 == 0) {
+			lst_pop(lst);
+			count++;
+			continue;
+		}
+
+		k = 1 + rand() % (depth - 1);
+		left_empty = stack_item(&lst->s, k) == bucket_lwb(lst, k);
+		lst_extract(lst, pivot_item(lst, lst->layout, k));
+		extracted++;
+
+		if (!left_empty && (int)stack_depth(&lst->s) != depth) {
+			fprintf(stderr, "%s: extracting pivot %d of %d changed the depth to %d\n",
+				name, k, depth, (int)stack_depth(&lst->s));
+		}
+		if (i % 16 == 1 && !lst_validate(lst, false)) {
+			fprintf(stderr, "%s: LST invalid after extracting pivot %d of %d\n", name, k, depth);
+		}
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid\n", name);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count + extracted != LST_TEST_SIZE) {
+		fprintf(stderr, "%s: popped %d and extracted %d of %d\n", name, count, extracted, LST_TEST_SIZE);
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_preserve_pivots(void)
+{
+	lst_opts_t	opts = { .preserve_pivots = true };
+	lst_partition_t	const partitions[] = { LST_PARTITION_HOARE, LST_PARTITION_THREE_WAY };
+
+	for (size_t i = 0; i < sizeof(partitions) / sizeof(partitions[0]); i++) {
+		opts.partition = partitions[i];
+		opts.key_project = NULL;
+		lst_test_preserve_pivots_run("lst_test_preserve_pivots()", &opts, 65537);
+		lst_test_preserve_pivots_run("lst_test_preserve_pivots(duplicates)", &opts, 8);
+		opts.key_project = heap_key;
+		lst_test_preserve_pivots_run("lst_test_preserve_pivots(cached)", &opts, 65537);
+	}
+	opts.key_project = NULL;
+	opts.partition = LST_PARTITION_HOARE;
+	opts.sort_threshold = -1;
+	lst_test_preserve_pivots_run("lst_test_preserve_pivots(unsorted)", &opts, 65537);
+}
+
+/*
+ * With lazy deletion, extracts leave tombstones that pops, iteration and
+ * compaction must all see past.
+ */
+static void lst_test_lazy_delete_run(char const *name, lst_opts_t const *opts, int key_range)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	lst_iter_t	iter;
+	int		live = 0, max_tombstones = 0, count;
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) array[i].data = rand() % key_range;
+
+	/*
+	 * Insert everything, popping now and then and extracting twice as
+	 * often, so the stack is deep and extracts land all over it.
+	 */
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		lst_insert(lst, &array[i]);
+		live++;
+		if (i % 8 == 7) {
+			lst_pop(lst);
+			live--;
+		}
+		if (i % 4 == 3) {
+			heap_thing	*victim = &array[rand() % (i + 1)];
+
+			if (victim->index >= 0 && lst_extract(lst, victim) > 0) live--;
+		}
+		if (lst->tombstones > max_tombstones) max_tombstones = lst->tombstones;
+		if (i % 256 == 255 && !lst_validate(lst, false)) {
+			fprintf(stderr, "%s: LST invalid after %d inserts\n", name, i + 1);
+		}
+	}
+	if (max_tombstones == 0) fprintf(stderr, "%s: no tombstones left\n", name);
+	if (lst_num_elements(lst) != live) {
+		fprintf(stderr, "%s: %d elements, expected %d\n", name, lst_num_elements(lst), live);
+	}
+
+	count = 0;
+	for (value = lst_iter_init(lst, &iter); value; value = lst_iter_next(lst, &iter)) {
+		if (value == lst->tombstone || value->index < 0) fprintf(stderr, "%s: iterated over a tombstone\n", name);
+		count++;
+	}
+	if (count != live) fprintf(stderr, "%s: iterated over %d elements, expected %d\n", name, count, live);
+
+	count = 0;
+	while ((value = lst_pop(lst)) != NULL) {
+		if (value == lst->tombstone) {
+			fprintf(stderr, "%s: popped a tombstone\n", name);
+			break;
+		}
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != live) fprintf(stderr, "%s: popped %d elements, expected %d\n", name, count, live);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_lazy_delete(void)
+{
+	lst_opts_t	opts = { .lazy_delete = 0.25 };
+
+	lst_test_lazy_delete_run("lst_test_lazy_delete()", &opts, 65537);
+	lst_test_lazy_delete_run("lst_test_lazy_delete(duplicates)", &opts, 8);
+	opts.lazy_delete = 1;
+	lst_test_lazy_delete_run("lst_test_lazy_delete(never compact)", &opts, 65537);
+	opts.preserve_pivots = true;
+	lst_test_lazy_delete_run("lst_test_lazy_delete(preserve pivots)", &opts, 65537);
+	opts.key_project = heap_key;
+	opts.sort_threshold = -1;
+	lst_test_lazy_delete_run("lst_test_lazy_delete(cached, unsorted)", &opts, 65537);
+}
+
+/*
+ * Chi-square statistic of observed counts against expected ones, over the
+ * categories 0 to n - 1, merging categories expected fewer than five times
+ * into their neighbours; *df is set to the degrees of freedom.
+ */
+static double chi_square(int const *observed, double const *expected, int n, int *df)
+{
+	double	chi = 0, o = 0, e = 0;
+	int	bins = 0;
+
+	for (int i = 0; i < n; i++) {
+		o += observed[i];
+		e += expected[i];
+		if (e < 5 && i < n - 1) continue;
+		chi += (o - e) * (o - e) / e;
+		bins++;
+		o = e = 0;
+	}
+	*df = bins - 1;
+	return chi;
+}
+
+/*
+ * Insert decides whether and where to flatten with a single draw. That
+ * must flatten at each level with the probability the paper's Insert
+ * does by drawing at every level: 1 / (s + 1) at a level with a subtree of
+ * size s, given no flatten shallower. Check both against those
+ * probabilities, for an insert below every pivot of a deep stack, where
+ * the flatten decisions matter most. The chi-square tests fail only ten
+ * standard deviations out, yet catch a bias of a few percent.
+ */
+static void lst_test_flatten_distribution(void)
+{
+	lst_opts_t	opts = { .deterministic = true, .seed = 13, .sort_threshold = -1 };
+	lst_t		*lst;
+	heap_thing	*array;
+	int		size = LST_TEST_SIZE, trials = 1000000, last, df;
+	int		single[64] = { 0 }, walk[64] = { 0 };
+	double		expected[64] = { 0 }, survive = 1, chi;
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	array = calloc(size, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "lst_test_flatten_distribution(): allocation failed\n");
+		goto done;
+	}
+
+	/*
+	 * The keys are fixed too, so that the stack depth is.
+	 */
+	for (int i = 0; i < size; i++) {
+		array[i].data = (i * 7919) % 65537;
+		lst_insert(lst, &array[i]);
+	}
+	lst_pop(lst);
+
+	last = stack_depth(&lst->s) - 1;
+	if (last < 2 || last >= 63) {
+		fprintf(stderr, "lst_test_flatten_distribution(): unsuitable stack depth %d\n", last + 1);
+		goto done;
+	}
+
+	/*
+	 * Category k is flattening at level k, and 0 not flattening.
+	 */
+	for (int k = 1; k <= last; k++) {
+		double	p = 1.0 / (lst_size(lst, lst->layout, k) + 1);
+
+		expected[k] = trials * survive * p;
+		survive *= 1 - p;
+	}
+	expected[0] = trials * survive;
+
+	for (int i = 0; i < trials; i++) {
+		int	k;
+
+		single[insert_flatten_level(lst, lst->layout, last)]++;
+
+		for (k = 1; k <= last; k++) if (lst_rand_range(lst, lst_size(lst, lst->layout, k) + 1) == 0) break;
+		walk[k > last ? 0 : k]++;
+	}
+
+	chi = chi_square(single, expected, last + 1, &df);
+	if (chi > df && (chi - df) * (chi - df) > 200 * df) {
+		fprintf(stderr, "lst_test_flatten_distribution(): single draw chi-square %.1f, %d df\n", chi, df);
+	}
+	chi = chi_square(walk, expected, last + 1, &df);
+	if (chi > df && (chi - df) * (chi - df) > 200 * df) {
+		fprintf(stderr, "lst_test_flatten_distribution(): per-level draws chi-square %.1f, %d df\n", chi, df);
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+/*
+ * Elements know where they are, so extracting them shouldn't need the
+ * comparator, whether or not they're pivots or equal to one.
+ */
+static void lst_test_extract_no_cmp(int key_range)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		count = 0, extracted = 0;
+
+	lst = lst_alloc(heap_cmp_counted, heap_thing, index);
+	array = calloc(LST_TEST_SIZE, sizeof(heap_thing));
+	if (!lst || !array) {
+		fprintf(stderr, "lst_test_extract_no_cmp(): allocation failed\n");
+		goto done;
+	}
+
+	for (int i = 0; i < LST_TEST_SIZE; i++) {
+		array[i].data = rand() % key_range;
+		lst_insert(lst, &array[i]);
+	}
+	for (int i = 0; i < LST_TEST_SIZE / 16; i++) lst_pop(lst);
+
+	cmp_calls = 0;
+	for (int i = 0; i < LST_TEST_SIZE; i += 3) {
+		if (array[i].index < 0) continue;
+		if (lst_extract(lst, &array[i]) < 0) {
+			fprintf(stderr, "lst_test_extract_no_cmp(): extract #%d failed\n", i);
+		}
+		extracted++;
+	}
+	if (cmp_calls != 0) {
+		fprintf(stderr, "lst_test_extract_no_cmp(): %d extracts made %d comparisons\n", extracted, cmp_calls);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_extract_no_cmp(): LST invalid\n");
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_extract_no_cmp(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != LST_TEST_SIZE - LST_TEST_SIZE / 16 - extracted) {
+		fprintf(stderr, "lst_test_extract_no_cmp(): popped %d, expected %d\n", count,
+			LST_TEST_SIZE - LST_TEST_SIZE / 16 - extracted);
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+/*
+ * An insert far to the left of a deep stack should search the pivots, not
+ * compare with each in turn: no more than twice log2 of the depth.
+ */
+static void lst_test_deep_insert(void)
+{
+	lst_opts_t	opts = { .sort_threshold = -1 };
+	heap_thing	*array, *value, *prev;
+	int		size = 1 << 16, half = size / 2;
+
+	array = calloc(size, sizeof(heap_thing));
+	if (!array) {
+		fprintf(stderr, "lst_test_deep_insert(): allocation failed\n");
+		return;
+	}
+
+	for (int trial = 0; trial < 16; trial++) {
+		lst_t	*lst = lst_alloc_opts(heap_cmp_marked, heap_thing, index, &opts);
+		int	depth, bound = 0, count = 0;
+
+		if (!lst) {
+			fprintf(stderr, "lst_test_deep_insert(): allocation failed\n");
+			break;
+		}
+
+		/*
+		 * The upper half goes in, and a pop partitions it down to a
+		 * deep stack. Then one of the lower half goes in, less than
+		 * every pivot; only comparisons with pivots count.
+		 */
+		for (int i = 0; i < size; i++) {
+			array[i].data = i < half ? i : half + rand() % half;
+			array[i].index = 0;
+		}
+		for (int i = half; i < size; i++) lst_insert(lst, &array[i]);
+		lst_pop(lst);
+
+		depth = stack_depth(&lst->s);
+		for (int d = 1; d < depth; d <<= 1) bound += 2;
+		for (int stack_index = 1; stack_index < depth; stack_index++) {
+			((heap_thing *)pivot_item(lst, lst->layout, stack_index))->visited = true;
+		}
+
+		cmp_calls = 0;
+		lst_insert(lst, &array[trial]);
+		if (cmp_calls > bound) {
+			fprintf(stderr, "lst_test_deep_insert(): insert at depth %d made %d comparisons\n",
+				depth, cmp_calls);
+		}
+		for (int i = 0; i < size; i++) array[i].visited = false;
+		if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_deep_insert(): LST invalid\n");
+
+		prev = NULL;
+		while ((value = lst_pop(lst)) != NULL) {
+			if (prev && heap_cmp(prev, value) > 0) {
+				fprintf(stderr, "lst_test_deep_insert(): pop yielded %d after %d\n",
+					value->data, prev->data);
+			}
+			prev = value;
+			count++;
+		}
+		if (count != half) fprintf(stderr, "lst_test_deep_insert(): popped %d of %d\n", count, half);
+		lst_free(lst);
+	}
+
+	free(array);
+}
+
+/*
+ * Inserts at the head of the queue go into the gap below lst->idx, so
+ * they leave every pivot where it was. Descending inserts into a new LST
+ * all go there, so lst->idx wraps around and the array expands with it
+ * near the end. The first LST stops short of a power of two, so that the
+ * inserts don't expand it. A segmented one starts on a segment boundary,
+ * so that the gap needs a segment of its own. An insert that flattens may
+ * rightly move pivots, so the run is a fixed one in which none does.
+ */
+static void lst_test_insert_front(bool segmented)
+{
+	lst_opts_t	opts = { .deterministic = true, .seed = 16, .sort_threshold = -1, .segmented = segmented };
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev;
+	int		size = 1 << 16, half = size / 2, count = 0;
+	lst_index_t	pivots[128];
+	int		depth;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	if (!array || !lst) {
+		fprintf(stderr, "lst_test_insert_front(): allocation failed\n");
+		goto done;
+	}
+	if (segmented) {
+		lst->idx = SEGMENT_SIZE;
+		stack_set(&lst->s, 0, lst->idx);
+	}
+
+	for (int i = 0; i < size; i++) array[i].data = i < half ? half - 1 - i : half + (i * 7919) % 65537;
+	for (int i = half; i < size - 64; i++) lst_insert(lst, &array[i]);
+	lst_pop(lst);
+
+	depth = stack_depth(&lst->s);
+	if (depth > 128) depth = 128;
+	for (int stack_index = 0; stack_index < depth; stack_index++) pivots[stack_index] = stack_item(&lst->s, stack_index);
+
+	for (int i = 0; i < 64; i++) {
+		lst_insert(lst, &array[i]);
+		for (int stack_index = 0; stack_index < depth; stack_index++) {
+			if (index_reduce(lst, lst->layout, stack_item(&lst->s, stack_index)) != index_reduce(lst, lst->layout, pivots[stack_index])) {
+				fprintf(stderr, "lst_test_insert_front(): insert %d moved pivot %d\n", i, stack_index);
+				break;
+			}
+		}
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_insert_front(): LST invalid\n");
+	lst_free(lst);
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	if (!lst) {
+		fprintf(stderr, "lst_test_insert_front(): allocation failed\n");
+		goto done;
+	}
+	for (int i = 0; i < half; i++) {
+		array[i].index = 0;
+		lst_insert(lst, &array[i]);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_insert_front(): LST invalid after expanding\n");
+
+	prev = NULL;
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_insert_front(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != half) fprintf(stderr, "lst_test_insert_front(): popped %d of %d\n", count, half);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+/*
+ * Segmented LSTs pass the usual checks, and growing one leaves every
+ * element in the same slot with the same index. The LST starts just
+ * short of where positions wrap around, so they wrap during the test.
+ */
+static void lst_test_segmented(void)
+{
+	lst_opts_t	opts = { .segmented = true };
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 8 * SEGMENT_SIZE, expansions = 0;
+	void		**slots;
+
+	lst_test_pop_order("lst_test_segmented()", &opts, 65537);
+	opts.partition = LST_PARTITION_BLOCK;
+	opts.key_project = heap_key;
+	lst_test_pop_order("lst_test_segmented(block, cached)", &opts, 65537);
+	opts.partition = LST_PARTITION_HOARE;
+	opts.key_project = NULL;
+	opts.lazy_delete = 0.25;
+	lst_test_lazy_delete_run("lst_test_segmented(lazy delete)", &opts, 65537);
+	opts.lazy_delete = 0;
+	lst_test_insert_front(true);
+
+	array = calloc(size, sizeof(heap_thing));
+	slots = calloc(size, sizeof(void *));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, &opts);
+	if (!array || !slots || !lst) {
+		fprintf(stderr, "lst_test_segmented(): allocation failed\n");
+		goto done;
+	}
+	lst->idx = POSITION_MASK - SEGMENT_SIZE / 2;
+	stack_set(&lst->s, 0, lst->idx);
+
+	for (int i = 0; i < size; i++) {
+		if (lst->num_elements == lst->capacity) {
+			for (int j = 0; j < i; j++) {
+				if (array[j].index >= 0) slots[j] = &item(lst, lst->layout, array[j].index);
+			}
+			if (!lst_expand(lst, lst->capacity + 1)) {
+				fprintf(stderr, "lst_test_segmented(): expansion failed\n");
+				break;
+			}
+			expansions++;
+			for (int j = 0; j < i; j++) {
+				if (array[j].index >= 0 && slots[j] != &item(lst, lst->layout, array[j].index)) {
+					fprintf(stderr, "lst_test_segmented(): growing moved element %d\n", j);
+					break;
+				}
+			}
+		}
+
+		array[i].data = rand() % 65537;
+		lst_insert(lst, &array[i]);
+		if (i % 3 == 2) lst_pop(lst);
+	}
+	if (expansions < 2) fprintf(stderr, "lst_test_segmented(): only %d expansions\n", expansions);
+	if (!lst_validate(lst, false)) fprintf(stderr, "lst_test_segmented(): LST invalid\n");
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_segmented(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(slots);
+	free(array);
+}
+
+/*
+ * Every element an LST holds must be at the position its index names,
+ * and the index must be reduced.
+ */
+static void lst_test_indices(char const *name, lst_t *lst, heap_thing *array, int size)
+{
+	for (int i = 0; i < size; i++) {
+		if (array[i].index >= 0 &&
+		    (array[i].index != index_reduce(lst, lst->layout, array[i].index) || item(lst, lst->layout, array[i].index) != &array[i])) {
+			fprintf(stderr, "%s: element %d not at its index %d\n", name, i, array[i].index);
+			return;
+		}
+	}
+}
+
+/*
+ * An LST with the shrink option gives memory back as it drains, keeping
+ * its elements and their order, and lst_shrink_to_fit() gives back the
+ * rest. The LST's positions wrap around before it shrinks.
+ */
+static void lst_test_shrink_run(char const *name, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 1 << 16, count = 0;
+	size_t		peak;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = rand() % 65537;
+		lst_insert(lst, &array[i]);
+		if (i % 4 == 3) {
+			value = lst_pop(lst);
+			value->data += rand() % 65537;
+			lst_insert(lst, value);
+		}
+	}
+	peak = lst_memory_usage(lst);
+
+	for (int i = 0; i < size; i += 3) lst_extract(lst, &array[i]);
+	while (lst_num_elements(lst) > size / 64) lst_pop(lst);
+	if (lst_memory_usage(lst) > peak / 4) {
+		fprintf(stderr, "%s: %zu bytes after draining, from %zu\n", name, lst_memory_usage(lst), peak);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after shrinking\n", name);
+	lst_test_indices(name, lst, array, size);
+
+	lst_shrink_to_fit(lst);
+	if (lst->capacity > 2 * SEGMENT_SIZE) fprintf(stderr, "%s: capacity %d after shrinking to fit\n", name, lst->capacity);
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after shrinking to fit\n", name);
+	lst_test_indices(name, lst, array, size);
+
+	for (int i = 0; i < size; i += 3) {
+		if (array[i].index < 0) lst_insert(lst, &array[i]);
+	}
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != size / 64 + (size + 2) / 3) fprintf(stderr, "%s: popped %d\n", name, count);
+	if (lst_memory_usage(lst) > peak / 4) fprintf(stderr, "%s: %zu bytes when empty\n", name, lst_memory_usage(lst));
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_shrink(void)
+{
+	lst_opts_t	opts = { .shrink = true };
+
+	lst_test_shrink_run("lst_test_shrink()", &opts);
+	opts.key_project = heap_key;
+	lst_test_shrink_run("lst_test_shrink(cached)", &opts);
+	opts.key_project = NULL;
+	opts.multiway = 8;
+	lst_test_shrink_run("lst_test_shrink(multiway)", &opts);
+	opts.multiway = 0;
+	opts.lazy_delete = 0.25;
+	lst_test_shrink_run("lst_test_shrink(lazy delete)", &opts);
+	opts.lazy_delete = 0;
+	opts.segmented = true;
+	lst_test_shrink_run("lst_test_shrink(segmented)", &opts);
+	opts.initial_capacity = 1000;
+	opts.growth = 1.5;
+	lst_test_shrink_run("lst_test_shrink(segmented, odd capacity)", &opts);
+	opts.segmented = false;
+	lst_test_shrink_run("lst_test_shrink(odd capacity)", &opts);
+	opts.initial_capacity = 0;
+	opts.growth = 0;
+	opts.segmented = true;
+	opts.key_project = heap_key;
+	lst_test_shrink_run("lst_test_shrink(segmented, cached)", &opts);
+}
+
+/*
+ * Allocation options set where an LST starts and how it grows, and
+ * lst_reserve() grows it in one step, however far, even when its
+ * positions have wrapped around. The LST is then no smaller than asked
+ * for, and holds the same elements in the same order.
+ */
+static void lst_test_reserve_run(char const *name, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 16384, count = 0;
+	lst_index_t	capacity;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+	if (lst->capacity < 5000 || (!opts->segmented && lst->capacity != 5000) || lst->s.size != 4) {
+		fprintf(stderr, "%s: capacity %d, stack capacity %d\n", name, lst->capacity, lst->s.size);
+	}
+	capacity = lst->capacity;
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = rand() % 65537;
+		array[i].index = -1;
+	}
+	for (int i = 0; i < capacity; i++) lst_insert(lst, &array[i]);
+	for (int i = 0; i < capacity - 100; i++) lst_pop(lst);
+	for (int i = capacity; i < 2 * capacity - 200; i++) lst_insert(lst, &array[i]);
+	if (lst->capacity != capacity) fprintf(stderr, "%s: grew before it was full\n", name);
+
+	if (lst_reserve(lst, 100000) < 0 || lst->capacity < 100000) {
+		fprintf(stderr, "%s: reserve left capacity %d\n", name, lst->capacity);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after reserving\n", name);
+	lst_test_indices(name, lst, array, size);
+	if (lst_reserve(lst, 1000) < 0) fprintf(stderr, "%s: reserve of less than the capacity failed\n", name);
+	if (lst_reserve(lst, (1 << 30) + 1) == 0) fprintf(stderr, "%s: reserve beyond the limit succeeded\n", name);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != capacity - 100) fprintf(stderr, "%s: popped %d of %d\n", name, count, capacity - 100);
+	if (opts->shrink && lst->capacity != capacity) fprintf(stderr, "%s: shrank to %d\n", name, lst->capacity);
+
+	/*
+	 * Filling it again grows it by the growth factor.
+	 */
+	if (!opts->shrink) {
+		capacity = lst->capacity;
+		for (int i = 0; i <= capacity && i < size; i++) lst_insert(lst, &array[i]);
+		if (capacity < size && lst->capacity < 3 * capacity) fprintf(stderr, "%s: grew to %d from %d\n", name, lst->capacity, capacity);
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_reserve(void)
+{
+	lst_opts_t	opts = { .initial_capacity = 5000, .stack_capacity = 4, .growth = 3 };
+
+	lst_test_reserve_run("lst_test_reserve()", &opts);
+	opts.key_project = heap_key;
+	lst_test_reserve_run("lst_test_reserve(cached)", &opts);
+	opts.shrink = true;
+	lst_test_reserve_run("lst_test_reserve(shrink)", &opts);
+	opts.segmented = true;
+	lst_test_reserve_run("lst_test_reserve(segmented, shrink)", &opts);
+	opts.shrink = false;
+	lst_test_reserve_run("lst_test_reserve(segmented)", &opts);
+}
+
+/*
+ * Capacities needn't be powers of two, nor growth factors whole. Popping
+ * as it fills keeps the LST's elements wrapped around the end of its
+ * array as it grows.
+ */
+static void lst_test_growth_run(char const *name, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 20000, count = 0, expected;
+	lst_index_t	capacity;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+	if (lst->capacity != opts->initial_capacity) fprintf(stderr, "%s: capacity %d\n", name, lst->capacity);
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = rand() % 65537;
+		array[i].index = -1;
+	}
+	for (int i = 0; i < size; i++) {
+		capacity = lst->capacity;
+		lst_insert(lst, &array[i]);
+		if (lst->capacity != capacity && lst->capacity > capacity * opts->growth + 1) {
+			fprintf(stderr, "%s: grew to %d from %d\n", name, lst->capacity, capacity);
+		}
+		if (i % 3 == 0) {
+			value = lst_pop(lst);
+			value->index = -1;
+		}
+	}
+
+	/*
+	 * Draining some and filling it again grows it with lst->idx at
+	 * other places in the array.
+	 */
+	for (int round = 0; round < 8; round++) {
+		capacity = lst->capacity;
+		while (lst_num_elements(lst) > capacity * (round + 2) / 12) {
+			value = lst_pop(lst);
+			value->index = -1;
+		}
+		for (int i = 0; i < size && lst->capacity == capacity; i++) {
+			if (array[i].index < 0) lst_insert(lst, &array[i]);
+		}
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after growing\n", name);
+	lst_test_indices(name, lst, array, size);
+	expected = lst_num_elements(lst);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != expected) fprintf(stderr, "%s: popped %d of %d\n", name, count, expected);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+/*
+ * Grow an LST whose elements wrap around the end of its array, by less
+ * than the number of them that wrap.
+ */
+static void lst_test_growth_wrapped(char const *name, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	heap_thing	array[160], *value;
+	int		size = sizeof(array) / sizeof(array[0]), count = 0;
+
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		return;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = i;
+		array[i].index = -1;
+	}
+	for (int i = 0; i < 100; i++) lst_insert(lst, &array[i]);
+	for (int i = 0; i < 40; i++) lst_pop(lst);
+	for (int i = 100; i < size; i++) lst_insert(lst, &array[i]);
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after growing\n", name);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (value->data != 40 + count) fprintf(stderr, "%s: pop yielded %d, not %d\n", name, value->data, 40 + count);
+		count++;
+	}
+	if (count != size - 40) fprintf(stderr, "%s: popped %d of %d\n", name, count, size - 40);
+
+	lst_free(lst);
+}
+
+static void lst_test_growth(void)
+{
+	lst_opts_t	opts = { .initial_capacity = 7, .growth = 1.25 };
+
+	lst_test_growth_run("lst_test_growth(1.25)", &opts);
+	opts.growth = 1.5;
+	lst_test_growth_run("lst_test_growth(1.5)", &opts);
+	opts.key_project = heap_key;
+	lst_test_growth_run("lst_test_growth(1.5, cached)", &opts);
+	opts.initial_capacity = 1000;
+	opts.growth = 3;
+	lst_test_growth_run("lst_test_growth(3, cached)", &opts);
+
+	opts.initial_capacity = 100;
+	opts.growth = 1.25;
+	lst_test_growth_wrapped("lst_test_growth(wrapped, cached)", &opts);
+	opts.key_project = NULL;
+	lst_test_growth_wrapped("lst_test_growth(wrapped)", &opts);
+}
+
+/*
+ * An LST without indexes must order its elements just as well, leave
+ * their index fields alone, and refuse to extract.
+ */
+#define UNINDEXED_SENTINEL	12345
+static void lst_test_unindexed_run(char const *name, lst_opts_t const *opts)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 20000, count = 0, expected = 0;
+	long		sum = 0;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_unindexed(heap_cmp, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = rand() % 65537;
+		array[i].index = UNINDEXED_SENTINEL;
+		sum += array[i].data;
+	}
+	for (int i = 0; i < size; i++) {
+		if (lst_insert(lst, &array[i]) < 0) fprintf(stderr, "%s: insert %d failed\n", name, i);
+		expected++;
+
+		/*
+		 * Pop now and then, so later inserts land among pivots.
+		 */
+		if (i % 5 == 4) {
+			lst_pop(lst);
+			expected--;
+		}
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after inserts\n", name);
+	if (lst_extract(lst, lst_peek(lst)) >= 0) fprintf(stderr, "%s: extract succeeded\n", name);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != expected) fprintf(stderr, "%s: popped %d of %d\n", name, count, expected);
+
+	/*
+	 * Stray index writes could land anywhere near the element.
+	 */
+	for (int i = 0; i < size; i++) {
+		if (array[i].index != UNINDEXED_SENTINEL) {
+			fprintf(stderr, "%s: element %d has index %d\n", name, i, array[i].index);
+			break;
+		}
+		sum -= array[i].data;
+	}
+	if (sum != 0) fprintf(stderr, "%s: element data changed\n", name);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_unindexed(void)
+{
+	lst_opts_t	opts = { 0 };
+
+	lst_test_unindexed_run("lst_test_unindexed()", &opts);
+	opts.key_project = heap_key;
+	lst_test_unindexed_run("lst_test_unindexed(cached)", &opts);
+	opts.segmented = true;
+	lst_test_unindexed_run("lst_test_unindexed(segmented, cached)", &opts);
+	opts.key_project = NULL;
+	opts.shrink = true;
+	lst_test_unindexed_run("lst_test_unindexed(segmented, shrink)", &opts);
+	opts = (lst_opts_t){ .multiway = 16 };
+	lst_test_unindexed_run("lst_test_unindexed(multiway)", &opts);
+	opts = (lst_opts_t){ .initial_capacity = 7, .growth = 1.5 };
+	lst_test_unindexed_run("lst_test_unindexed(1.5)", &opts);
+}
+
+/*
+ * Bucket slack leaves the same tombstones as lazy deletion, and inserts
+ * must fill them without losing or misplacing anything, whatever else
+ * moves them about.
+ */
+static void lst_test_bucket_slack(void)
+{
+	lst_opts_t	opts = { .bucket_slack = 8 };
+
+	lst_test_lazy_delete_run("lst_test_bucket_slack()", &opts, 65537);
+	lst_test_lazy_delete_run("lst_test_bucket_slack(duplicates)", &opts, 8);
+	opts.lazy_delete = 0.25;
+	lst_test_lazy_delete_run("lst_test_bucket_slack(lazy delete)", &opts, 65537);
+	opts.preserve_pivots = true;
+	lst_test_lazy_delete_run("lst_test_bucket_slack(preserve pivots)", &opts, 65537);
+	opts = (lst_opts_t){ .bucket_slack = 255, .key_project = heap_key };
+	lst_test_lazy_delete_run("lst_test_bucket_slack(255, cached)", &opts, 65537);
+	opts = (lst_opts_t){ .bucket_slack = 8, .segmented = true };
+	lst_test_lazy_delete_run("lst_test_bucket_slack(segmented)", &opts, 65537);
+	opts = (lst_opts_t){ .bucket_slack = 8, .initial_capacity = 7, .growth = 1.5 };
+	lst_test_lazy_delete_run("lst_test_bucket_slack(1.5)", &opts, 65537);
+	opts = (lst_opts_t){ .bucket_slack = 8 };
+	lst_test_unindexed_run("lst_test_bucket_slack(unindexed)", &opts);
+}
+
+/*
+ * Prefetching mustn't change what an LST does, but it reads array slots
+ * ahead of where it moves and compares elements, so try it with each
+ * kernel and layout.
+ */
+static void lst_test_prefetch(void)
+{
+	lst_opts_t	opts = { .prefetch = true };
+
+	lst_test_pop_order("lst_test_prefetch()", &opts, 65537);
+	lst_test_pop_order("lst_test_prefetch(duplicates)", &opts, 8);
+	opts.partition = LST_PARTITION_BLOCK;
+	lst_test_pop_order("lst_test_prefetch(block)", &opts, 65537);
+	opts.partition = LST_PARTITION_HOARE;
+	opts.key_project = heap_key;
+	lst_test_pop_order("lst_test_prefetch(cached)", &opts, 65537);
+	opts.segmented = true;
+	lst_test_pop_order("lst_test_prefetch(segmented, cached)", &opts, 65537);
+	opts.key_project = NULL;
+	lst_test_pop_order("lst_test_prefetch(segmented)", &opts, 65537);
+	opts.shrink = true;
+	lst_test_shrink_run("lst_test_prefetch(segmented, shrink)", &opts);
+
+	opts = (lst_opts_t){ .prefetch = true, .initial_capacity = 7, .growth = 1.5 };
+	lst_test_growth_run("lst_test_prefetch(1.5)", &opts);
+	lst_test_unindexed_run("lst_test_prefetch(unindexed)", &opts);
+}
+
+/*
+ * mom_select() must leave the element of rank k at low + k, with none
+ * greater before it and none smaller after, and the LST intact.
+ */
+static void lst_test_mom_select_run(char const *name, lst_opts_t const *opts, int size, int key_range)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	lst_index_t	low, at;
+	int		count = 0;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = rand() % key_range;
+		lst_insert(lst, &array[i]);
+	}
+
+	low = lst->idx;
+	for (int k = 0; k < size; k += 1 + size / 7) {
+		at = mom_select(lst, low, low + size - 1, k);
+		if (at != low + k) fprintf(stderr, "%s: rank %d selected at %d\n", name, k, at - low);
+		for (int i = 0; i < size; i++) {
+			int	cmp = heap_cmp(item(lst, lst->layout, low + i), item(lst, lst->layout, at));
+
+			if ((i < k && cmp > 0) || (i > k && cmp < 0)) {
+				fprintf(stderr, "%s: rank %d misplaced against %d\n", name, k, i);
+				break;
+			}
+		}
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after selecting\n", name);
+	lst_test_indices(name, lst, array, size);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != size) fprintf(stderr, "%s: popped %d of %d\n", name, count, size);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_mom_select(void)
+{
+	lst_opts_t	opts = { 0 };
+
+	lst_test_mom_select_run("lst_test_mom_select()", &opts, 5000, 65537);
+	lst_test_mom_select_run("lst_test_mom_select(duplicates)", &opts, 5000, 8);
+	lst_test_mom_select_run("lst_test_mom_select(small)", &opts, 7, 65537);
+	opts.key_project = heap_key;
+	lst_test_mom_select_run("lst_test_mom_select(cached)", &opts, 5000, 65537);
+}
+
+/*
+ * A pivot stack far deeper than log2 of the number of elements, here one
+ * pivot for every third element, is thinned by the next extract to at
+ * most one pivot per halving, keeping the elements, their order, and what
+ * the merged buckets know about it. With lazy deletion, tombstones laid
+ * in the deep stack have to be dropped before pops reach them.
+ */
+static void lst_test_rebalance_run(char const *name, lst_opts_t const *opts, bucket_order_t order)
+{
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	lst_stats_t	stats;
+	bool		cached = opts->key_project != NULL;
+	int		size = 1024, count = 0, extracted = 0;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(heap_cmp, heap_thing, index, opts);
+	if (!array || !lst) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		goto done;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = i;
+		lst_insert(lst, &array[i]);
+	}
+
+	/*
+	 * Sort, then make every third element a pivot, leaving two elements
+	 * in each bucket, swapped unless the buckets are to be sorted. One
+	 * near the tail is swapped regardless, so the bucket it merges into
+	 * can't stay sorted.
+	 */
+	bucket_sort(lst, lst->idx, size, cached, lst->layout);
+	for (lst_index_t at = lst->idx + size - 3; at > lst->idx; at -= 3) {
+		bool	swap = order == BUCKET_UNORDERED || at == lst->idx + size - 300;
+
+		stack_push(&lst->s, at, location_key(lst, cached, lst->layout, at));
+		if (swap) lst_swap(lst, cached, lst->layout, at + 1, at + 2);
+		stack_set_order(&lst->s, stack_depth(&lst->s) - 2, swap ? BUCKET_UNORDERED : order);
+	}
+	stack_set_order(&lst->s, stack_depth(&lst->s) - 1, order);
+
+	/*
+	 * Pivots are at offsets that are multiples of three from the head.
+	 */
+	for (int i = 1; lst->tombstone && i < size; i += 97) {
+		if (offset_reduce(lst, lst->layout, item_index(lst, &array[i]) - lst->idx) % 3 == 0) continue;
+		_lst_extract(lst, &array[i], lst->layout);
+		extracted++;
+	}
+	if (lst->tombstone && lst->tombstones == 0) fprintf(stderr, "%s: no tombstones laid\n", name);
+
+	lst_stats(lst, &stats);
+	if (stats.rebalances != 0 || stats.depth < size / 3 - 1) {
+		fprintf(stderr, "%s: stack of %d built with %llu rebalances\n", name, stats.depth,
+			(unsigned long long)stats.rebalances);
+	}
+
+	lst_extract(lst, &array[size - 1]);
+	extracted++;
+
+	lst_stats(lst, &stats);
+	if (stats.rebalances != 1) fprintf(stderr, "%s: %llu rebalances\n", name, (unsigned long long)stats.rebalances);
+	if (stats.depth > 32 - __builtin_clz(size)) fprintf(stderr, "%s: stack still %d deep\n", name, stats.depth);
+	if (order == BUCKET_SORTED && stack_order(&lst->s, 1) != BUCKET_SORTED) {
+		fprintf(stderr, "%s: merged sorted buckets not marked sorted\n", name);
+	}
+	if (!lst_validate(lst, false)) fprintf(stderr, "%s: LST invalid after rebalancing\n", name);
+	lst_test_indices(name, lst, array, size);
+
+	while ((value = lst_pop(lst)) != NULL) {
+		if (value == lst->tombstone) {
+			fprintf(stderr, "%s: popped a tombstone\n", name);
+			break;
+		}
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "%s: pop yielded %d after %d\n", name, value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != size - extracted) fprintf(stderr, "%s: popped %d of %d\n", name, count, size - extracted);
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_test_rebalance(void)
+{
+	lst_opts_t	opts = { 0 };
+
+	lst_test_rebalance_run("lst_test_rebalance()", &opts, BUCKET_UNORDERED);
+	lst_test_rebalance_run("lst_test_rebalance(sorted)", &opts, BUCKET_SORTED);
+	opts.key_project = heap_key;
+	lst_test_rebalance_run("lst_test_rebalance(cached)", &opts, BUCKET_SORTED);
+	opts.key_project = NULL;
+	opts.lazy_delete = 0.5;
+	lst_test_rebalance_run("lst_test_rebalance(lazy delete)", &opts, BUCKET_UNORDERED);
+}
+
+/*
+ * McIlroy's adversary for quicksort ("A Killer Adversary for Quicksort",
+ * 1999): every element starts as "gas", greater than any value given out,
+ * and the comparator gives gas a value only when it must, choosing the
+ * element it suspects is the pivot to stay gas, so that pivots turn out
+ * to be the largest elements of their buckets. Until it's armed, it
+ * orders elements by a hash of their addresses, so that the inserts
+ * leave the LST one unordered bucket without deciding anything.
+ */
+#define ADVERSARY_GAS	INT_MAX
+
+static heap_thing	*adversary_candidate;
+static int		adversary_solid;
+static bool		adversary_armed;
+static long		adversary_compares;
+
+static uint32_t adversary_hash(void const *data)
+{
+	return ((uint64_t)(uintptr_t)data * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+}
+
+static int8_t adversary_cmp(void const *one, void const *two)
+{
+	heap_thing	*item1 = (heap_thing *)one, *item2 = (heap_thing *)two;
+
+	if (!adversary_armed) return (adversary_hash(one) > adversary_hash(two)) - (adversary_hash(two) > adversary_hash(one));
+
+	adversary_compares++;
+	if (item1->data == ADVERSARY_GAS && item2->data == ADVERSARY_GAS) {
+		if (item1 == adversary_candidate) {
+			item1->data = adversary_solid++;
+		} else {
+			item2->data = adversary_solid++;
+		}
+	}
+	if (item1->data == ADVERSARY_GAS) {
+		adversary_candidate = item1;
+	} else if (item2->data == ADVERSARY_GAS) {
+		adversary_candidate = item2;
+	}
+	return heap_cmp(one, two);
+}
+
+/*
+ * Against the adversary, the median of medians fallback keeps draining
+ * an LST to about 2 n log n comparisons; without it, it takes ten times
+ * as many.
+ */
+static void lst_test_adversary(void)
+{
+	lst_opts_t	opts = { .deterministic = true, .seed = 24 };
+	lst_t		*lst;
+	heap_thing	*array, *value, *prev = NULL;
+	int		size = 10000, count = 0;
+
+	adversary_candidate = NULL;
+	adversary_solid = 0;
+	adversary_armed = false;
+	adversary_compares = 0;
+
+	array = calloc(size, sizeof(heap_thing));
+	lst = lst_alloc_opts(adversary_cmp, heap_thing, index, &opts);
+	if (!array || !lst) {
+		fprintf(stderr, "lst_test_adversary(): allocation failed\n");
+		goto done;
+	}
+
+	for (int i = 0; i < size; i++) {
+		array[i].data = ADVERSARY_GAS;
+		lst_insert(lst, &array[i]);
+	}
+	if (stack_order(&lst->s, 0) != BUCKET_UNORDERED) fprintf(stderr, "lst_test_adversary(): inserts left the bucket ordered\n");
+
+	adversary_armed = true;
+	while ((value = lst_pop(lst)) != NULL) {
+		if (prev && heap_cmp(prev, value) > 0) {
+			fprintf(stderr, "lst_test_adversary(): pop yielded %d after %d\n", value->data, prev->data);
+		}
+		prev = value;
+		count++;
+	}
+	if (count != size) fprintf(stderr, "lst_test_adversary(): popped %d of %d\n", count, size);
+	if (adversary_compares > 4L * size * 14) {
+		fprintf(stderr, "lst_test_adversary(): %ld comparisons to drain %d elements\n", adversary_compares, size);
+	}
+
+done:
+	if (lst) lst_free(lst);
+	free(array);
+}
+
+static void lst_iter(void)
+{
+	lst_t	*lst;
+	lst_iter_t	iter;
+	heap_thing	values[NVALUES], *data;
+
+	lst = lst_alloc(heap_cmp, heap_thing, index);
+	if (lst == NULL) {
+		fprintf(stderr, "lst_iter(): failed to create lst\n");
+		return;
+	}
+
+	for (int i = 0; i < NVALUES; i++) {
+		values[i].data = i;
+		values[i].index = 0;
+		values[i].visited = false;
+	}
+
+	for (int i = 0; i < NVALUES - 1; i++) {
+		int	j = rand() % (NVALUES - i);
+		int	temp = values[i].data;
+
+		values[i].data = values[j].data;
+		values[j].data = temp;
+	}
+
+	for (int i = 0; i < NVALUES; i++) {
+		if (lst_insert(lst, &values[i]) < 0) {
+			fprintf(stderr, "lst_iter(): insert #%d failed\n", i + 1);
+		}
+	}
+
+	data = lst_iter_init(lst, &iter);
+
+	for (int i = 0; i < NVALUES; i++, data = lst_iter_next(lst, &iter)) {
+		if (data == NULL) {
+			fprintf(stderr, "lst_iter(): unexpected end at %d\n", i);
+		} else {
+			if (data->visited) {
+				fprintf(stderr, "lst_iter(): visited element more than once\n");
+			}
+			if (data->index < 0) {
+				fprintf(stderr, "lst_iter(): visited element not in LST\n");
+			}
+			data->visited = true;
+		}
+	}
+
+	if (data != NULL) {
+		fprintf(stderr, "lst_iter(): iterator didn't terminate as expected\n");
+	}
+	lst_free(lst);
+}
+
+static bool lst_validate(lst_t *lst, bool show_items)
+{
+	lst_index_t	fake_pivot_index, reduced_fake_pivot_index, reduced_end;
+	int		depth = stack_depth(&lst->s);
+	int		bucket_size_sum;
+	bool		pivots_in_order = true;
+	bool		pivot_indices_in_order = true;
+	bool		is_valid = true;
+
+	/*
+	 * There has to be at least the fictitious pivot.
+	 */
+	if (depth < 1) {
+		fprintf(stderr, "lst_validate(): LST pivot stack empty\n");
+		return false;
+	}
+
+	/*
+	 * Modulo circularity, idx + the number of elements should be the index
+	 * of the fictitious pivot.
+	 */
+	fake_pivot_index = stack_item(&lst->s, 0);
+	reduced_fake_pivot_index = index_reduce(lst, lst->layout, fake_pivot_index);
+	reduced_end = index_reduce(lst, lst->layout, lst->idx + lst->num_elements);
+	if (reduced_fake_pivot_index != reduced_end) {
+		fprintf(stderr, "lst_validate(): fictitious pivot inconsistent with idx and number of elements");
+		is_valid = false;
+	}
+
+	/*
+	 * Bucket sizes must make sense.
+	 */
+	if (lst->num_elements) {
+		bucket_size_sum = 0;
+
+		for (int stack_index = 0; stack_index < depth; stack_index++)  {
+			lst_index_t bucket_size = bucket_upb(lst, stack_index) - bucket_lwb(lst, stack_index) + 1;
+			if (bucket_size > lst->num_elements) {
+				fprintf(stderr, "bucket %d size %d is invalid\n", stack_index, bucket_size);
+				is_valid = false;
+			}
+			bucket_size_sum += bucket_size;
+		}
+
+		if (bucket_size_sum + depth - 1 != lst->num_elements) {
+			fprintf(stderr, "total bucket size inconsistent with number of elements\n");
+			is_valid = false;
+		}
+	}
+
+	/*d
+	 * No elements should be NULL.
+	 */
+	for (lst_index_t i = 0; i < lst->num_elements; i++) {
+		if (!item(lst, lst->layout, lst->idx + i)) {
+			fprintf(stderr, "null element at %d\n", lst->idx + i);
+			is_valid = false;
+		}
+	}
+
+	/*
+	 * Cached keys must be those of the elements they're cached with.
+	 */
+	for (lst_index_t i = 0; lst->key_project && i < lst->num_elements; i++) {
+		if (is_tombstone(lst, lst->layout, lst->idx + i)) continue;
+		if (item_key(lst, lst->layout, lst->idx + i) != lst->key_project(item(lst, lst->layout, lst->idx + i))) {
+			fprintf(stderr, "stale cached key at %d\n", lst->idx + i);
+			is_valid = false;
+		}
+	}
+	for (int stack_index = 1; lst->key_project && stack_index < depth; stack_index++) {
+		if (stack_key(&lst->s, stack_index) != lst->key_project(pivot_item(lst, lst->layout, stack_index))) {
+			fprintf(stderr, "stale cached key for pivot %d\n", stack_index);
+			is_valid = false;
+		}
+	}
+
+	/*
+	 * There's nothing more to check for a one-bucket tree.
+	 */
+	if (is_bucket(lst, 0)) return is_valid;
+
+	/*
+	 * Otherwise, first, pivots from left to right (aside from the fictitious
+	 * one) should be in ascending order.
+	 */
+	for (int stack_index = 1; stack_index + 1 < depth; stack_index++) {
+		heap_thing	*current_pivot = pivot_item(lst, lst->layout, stack_index);
+		heap_thing	*next_pivot = pivot_item(lst, lst->layout, stack_index + 1);
+
+		if (current_pivot && next_pivot && lst->cmp(current_pivot, next_pivot) < 0) pivots_in_order = false;
+	}
+	if (!pivots_in_order) {
+		fprintf(stderr, "pivots not in ascending order\n");
+		is_valid = false;
+	}
+
+	/*
+	 * Next, all non-fictitious pivots must correspond to non-null elements of the array.
+	 */
+	for (int stack_index = 1; stack_index < depth; stack_index++) {
+		if (!pivot_item(lst, lst->layout, stack_index)) {
+			fprintf(stderr, "pivot #%d refers to NULL", stack_index);
+			is_valid = false;
+		}
+		if (lst->tombstones && is_tombstone(lst, lst->layout, stack_item(&lst->s, stack_index))) {
+			fprintf(stderr, "pivot #%d is a tombstone\n", stack_index);
+			is_valid = false;
+		}
+	}
+
+	/*
+	 * Next, the stacked pivot indices should decrease as you ascend from
+	 * the bottom of the pivot stack. Here we *do* include the fictitious
+	 * pivot; we're just comparing indices.
+	 */
+	for (int stack_index = 0; stack_index + 1 < depth; stack_index++) {
+		lst_index_t current_pivot_index = stack_item(&lst->s, stack_index);
+		lst_index_t previous_pivot_index = stack_item(&lst->s, stack_index + 1);
+
+
+		if (previous_pivot_index >= current_pivot_index) pivot_indices_in_order = false;
+	}
+
+	if (!pivot_indices_in_order) {
+		fprintf(stderr, "pivot indices not in order\n");
+		is_valid = false;
+	}
+
+	/*
+	 * Finally...
+	 * values in buckets shouldn't "follow" the pivot to the immediate right (if it exists)
+	 * and shouldn't "precede" the pivot to the immediate left (if it exists)
+	 *
+	 * todo: this will find pivot ordering issues as well; get rid of that ultimately,
 	 * since pivot-pivot ordering errors are caught above.
 	 */
 	for (int stack_index = 0; stack_index < depth; stack_index++) {
@@ -581,24 +2479,24 @@ static bool lst_validate(lst_t *lst, bool show_items)
 		void		*pivot, *element;
 
 		if (stack_index > 0) {
-			lwb = (stack_index + 1 == depth) ? lst->idx : stack_item(lst->s, stack_index + 1);
-			pivot_index = upb = stack_item(lst->s, stack_index);
-			pivot = item(lst, pivot_index);
+			lwb = (stack_index + 1 == depth) ? lst->idx : stack_item(&lst->s, stack_index + 1);
+			pivot_index = upb = stack_item(&lst->s, stack_index);
+			pivot = item(lst, lst->layout, pivot_index);
 			for (lst_index_t index = lwb; index < upb; index++) {
-				element = item(lst, index);
-				if (element && pivot && lst->cmp(element, pivot) > 0) {
+				element = item(lst, lst->layout, index);
+				if (element && element != lst->tombstone && pivot && lst->cmp(element, pivot) > 0) {
 					fprintf(stderr, "element at %d > pivot at %d\n", index, pivot_index);
 					is_valid = false;
 				}
 			}
 		}
 		if (stack_index + 1 < depth) {
-			upb = stack_item(lst->s, stack_index);
-			lwb = pivot_index = stack_item(lst->s, stack_index + 1);
-			pivot = item(lst, pivot_index);
+			upb = stack_item(&lst->s, stack_index);
+			lwb = pivot_index = stack_item(&lst->s, stack_index + 1);
+			pivot = item(lst, lst->layout, pivot_index);
 			for (lst_index_t index = lwb; index < upb; index++) {
-				element = item(lst, index);
-				if (element && pivot && lst->cmp(pivot, element) > 0) {
+				element = item(lst, lst->layout, index);
+				if (element && element != lst->tombstone && pivot && lst->cmp(pivot, element) > 0) {
 					fprintf(stderr,  "element at %d < pivot at %d\n", index, pivot_index);
 					is_valid = false;
 				}
@@ -606,9 +2504,64 @@ static bool lst_validate(lst_t *lst, bool show_items)
 		}
 	}
 
+	/*
+	 * Tombstones must all be counted, and only in unordered buckets.
+	 */
+	if (lst->tombstones) {
+		lst_index_t	tombstones = 0;
+
+		for (int stack_index = 0; stack_index < depth; stack_index++) {
+			lst_index_t	lwb = bucket_lwb(lst, stack_index), upb = bucket_upb(lst, stack_index);
+
+			for (lst_index_t index = lwb; index <= upb; index++) {
+				if (!is_tombstone(lst, lst->layout, index)) continue;
+				tombstones++;
+				if (stack_order(&lst->s, stack_index) != BUCKET_UNORDERED) {
+					fprintf(stderr, "tombstone at %d in ordered bucket %d\n", index, stack_index);
+					is_valid = false;
+				}
+			}
+		}
+		if (tombstones != lst->tombstones) {
+			fprintf(stderr, "%d tombstones in buckets, %d counted\n", tombstones, lst->tombstones);
+			is_valid = false;
+		}
+	}
+
+	/*
+	 * Buckets marked as sorted must be.
+	 */
+	for (int stack_index = 0; stack_index < depth; stack_index++) {
+		lst_index_t	lwb = bucket_lwb(lst, stack_index), upb = bucket_upb(lst, stack_index);
+
+		if (stack_order(&lst->s, stack_index) != BUCKET_SORTED) continue;
+		for (lst_index_t index = lwb + 1; index <= upb; index++) {
+			if (lst->cmp(item(lst, lst->layout, index - 1), item(lst, lst->layout, index)) > 0) {
+				fprintf(stderr, "bucket %d marked sorted but isn't\n", stack_index);
+				is_valid = false;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Buckets marked as all equal must be.
+	 */
+	for (int stack_index = 0; stack_index < depth; stack_index++) {
+		lst_index_t	lwb = bucket_lwb(lst, stack_index), upb = bucket_upb(lst, stack_index);
+
+		if (stack_order(&lst->s, stack_index) != BUCKET_EQUAL) continue;
+		for (lst_index_t index = lwb + 1; index <= upb; index++) {
+			if (lst->cmp(item(lst, lst->layout, lwb), item(lst, lst->layout, index)) != 0) {
+				fprintf(stderr, "bucket %d marked equal but isn't\n", stack_index);
+				is_valid = false;
+				break;
+			}
+		}
+	}
+
 	return is_valid;
 }
-#endif
 
 int main(int argc, char **argv)
 {
@@ -620,6 +2573,32 @@ int main(int argc, char **argv)
 	lst_burn_in();
 	lst_cycle();
 	lst_iter();
+	lst_test_deterministic();
+	lst_test_pivot_policies();
+	lst_test_three_way();
+	lst_test_block_partition();
+	lst_test_keyed();
+	lst_test_multiway();
+	lst_test_sorted_run();
+	lst_test_presorted();
+	lst_test_key_cache();
+	lst_test_deep_insert();
+	lst_test_extract_no_cmp(65537);
+	lst_test_extract_no_cmp(8);
+	lst_test_flatten_distribution();
+	lst_test_preserve_pivots();
+	lst_test_lazy_delete();
+	lst_test_bucket_slack();
+	lst_test_insert_front(false);
+	lst_test_segmented();
+	lst_test_shrink();
+	lst_test_reserve();
+	lst_test_growth();
+	lst_test_unindexed();
+	lst_test_prefetch();
+	lst_test_mom_select();
+	lst_test_adversary();
+	lst_test_rebalance();
 
 	return EXIT_SUCCESS;
 }